@@ -378,6 +378,7 @@ private:
     static const int DEFAULT_REGION_SIZE_MIN = 10;
 
     SrcT* src_frame;
+    int   src_step; // bytes per row of src_frame
     DstT* dst_frame;
     int   width;
     int   height;
@@ -396,6 +397,13 @@ private:
 
     // private functions
 
+    inline SrcT*
+    SrcRow(const int y) const
+    {
+        return reinterpret_cast<SrcT*>(reinterpret_cast<char*>(src_frame)
+                                       + (size_t)y * src_step);
+    }
+
     void
     RegisterSegment(const int  lx,
                     const int  rx,
@@ -615,8 +623,30 @@ public:
          int        target_height,
          const bool is_sort_region,
          const int  region_size_min)
+    {
+        return Exec(target,
+                    target_width * sizeof(SrcT),
+                    result,
+                    target_width,
+                    target_height,
+                    is_sort_region,
+                    region_size_min);
+    }
+
+    // target_step: bytes per row of target (e.g. cv::Mat::step), so that
+    // an image can be labeled in place without copying it. result is
+    // always packed (target_width per row).
+    int
+    Exec(SrcT*      target,
+         int        target_step,
+         DstT*      result,
+         int        target_width,
+         int        target_height,
+         const bool is_sort_region,
+         const int  region_size_min)
     {
         src_frame = target;
+        src_step = target_step;
         dst_frame = result;
 
         width = target_width;
@@ -640,7 +670,7 @@ public:
 
         // phase 1
 
-        SrcT* p = src_frame;
+        SrcT* p;
 
 #if (CLEAR_DST_BUFFER || CLEAR_ALL_DST_BUFFER)
         DstT* q = dst_frame;
@@ -654,6 +684,7 @@ public:
             for (int y = 0; y < height; y++) {
                 int lx = 0;
                 int current_src_value = 0;
+                p = SrcRow(y);
                 for (int x = 0; x < width; x++) {
                     if (*p != current_src_value) {
                         if (current_src_value != 0) { // raster segment
@@ -678,6 +709,7 @@ public:
             for (int y = 0; y < height; y++) {
                 int lx = 0;
                 int current_src_value = 0;
+                p = SrcRow(y);
                 for (int x = 0; x < width; x++) {
                     if (*p != current_src_value) {
                         if (current_src_value != 0) { // raster segment
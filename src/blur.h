@@ -0,0 +1,142 @@
+/*
+ * blur.h
+ *
+ * Copyright (c) 2012, Seiichi Uchida. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 方向特徴のぼけ変換 (subr.cppとthinning.cppで共用)
+ *
+ * ガウス関数 exp(-(x^2+y^2)/(2σ^2)) は exp(-x^2/(2σ^2)) exp(-y^2/(2σ^2))
+ * と分解できるので、縦横それぞれの1次元の畳み込みで計算する。重みは
+ * BLUR_ONEを1.0とする固定小数点で、画素ごとに並べたchannels個の方向
+ * 特徴をまとめて処理する。thinning.cppは単独でもビルドする (make thin)
+ * ので、関数はこのヘッダに置く。
+ */
+
+#ifndef BLUR_H
+#define BLUR_H
+
+#define BLUR_ONE          4096 /* 固定小数点の1.0 */
+#define BLUR_MAX_RADIUS   4
+#define BLUR_MAX_CHANNELS 8
+
+/* 分散σ^2=4のガウス関数 exp(-x^2/8) (正規化項は無し) */
+static const int blur_gauss4[BLUR_MAX_RADIUS + 1] = {
+    4096, 3615, 2484, 1330, 554
+};
+
+/* 分散σ^2=2のガウス関数 exp(-x^2/4) (正規化項は無し) */
+static const int blur_gauss2[BLUR_MAX_RADIUS + 1] = {
+    4096, 3190, 1507, 432, 75
+};
+
+/*
+ * 画像の範囲内に収まる1次元の重みの和
+ *
+ * wsum[x]に座標xでの和を求め、端にかからない場合の和を返す (いずれも
+ * BLUR_ONEを1.0とする)。2次元の重みの和はwsum[x] * wsum[y]になる。
+ */
+static inline double
+blur_border(const int* kernel, int radius, double wsum[N])
+{
+    int x, i, w, total;
+
+    total = kernel[0];
+    for (i = 1; i <= radius; i++) {
+        total += 2 * kernel[i];
+    }
+    for (x = 0; x < N; x++) {
+        w = 0;
+        for (i = -radius; i <= radius; i++) {
+            if (x + i >= 0 && x + i < N) {
+                w += kernel[ABS(i)];
+            }
+        }
+        wsum[x] = (double)w / BLUR_ONE;
+    }
+    return (double)total / BLUR_ONE;
+}
+
+/*
+ * src[N][N][channels]をぼかしてdstに格納する
+ *
+ * dst[x][y][c] = Σ kernel[|i|] kernel[|j|] src[x+i][y+j][c] (画像の外は
+ * 除く) で、重みの和による正規化はしない。整数で計算するので、結果は
+ * 加算の順序によらない。
+ */
+static inline void
+blur_separable(const int* src,
+               double*    dst,
+               int        channels,
+               const int* kernel,
+               int        radius)
+{
+    int       tmp[N][N][BLUR_MAX_CHANNELS];
+    long long acc[BLUR_MAX_CHANNELS];
+    int       x, y, i, c, lo, hi, k;
+
+    // 横 (y) 方向
+    for (x = 0; x < N; x++) {
+        for (y = 0; y < N; y++) {
+            lo = (y < radius) ? -y : -radius;
+            hi = (y + radius >= N) ? N - 1 - y : radius;
+            for (c = 0; c < channels; c++) {
+                tmp[x][y][c] = 0;
+            }
+            for (i = lo; i <= hi; i++) {
+                const int* s = src + (x * N + y + i) * channels;
+
+                k = kernel[ABS(i)];
+                for (c = 0; c < channels; c++) {
+                    tmp[x][y][c] += k * s[c];
+                }
+            }
+        }
+    }
+
+    // 縦 (x) 方向
+    for (x = 0; x < N; x++) {
+        lo = (x < radius) ? -x : -radius;
+        hi = (x + radius >= N) ? N - 1 - x : radius;
+        for (y = 0; y < N; y++) {
+            for (c = 0; c < channels; c++) {
+                acc[c] = 0;
+            }
+            for (i = lo; i <= hi; i++) {
+                k = kernel[ABS(i)];
+                for (c = 0; c < channels; c++) {
+                    acc[c] += (long long)k * tmp[x + i][y][c];
+                }
+            }
+            for (c = 0; c < channels; c++) {
+                dst[(x * N + y) * channels + c] =
+                    (double)acc[c] / ((double)BLUR_ONE * BLUR_ONE);
+            }
+        }
+    }
+}
+
+#endif /* BLUR_H */
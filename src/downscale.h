@@ -0,0 +1,65 @@
+/*
+ * downscale.h
+ *
+ * Copyright (c) 2012, Seiichi Uchida. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 大きすぎる入力画像の縮小 (subr.cpp, thinning.cpp, kocr_cnn.cppで共用)
+ *
+ * 高解像度でスキャンした文字画像は、膨張・収縮や距離変換などを画素数
+ * に比例した時間で行うことになるので、最初に高さTARGET_CHAR_HEIGHTまで
+ * 面積平均 (INTER_AREA) で縮小する。縦横比は保つ。既定値は手元の
+ * 画像 (高さ130画素程度まで) には影響しない大きさにしてある。
+ */
+
+#ifndef DOWNSCALE_H
+#define DOWNSCALE_H
+
+#ifndef TARGET_CHAR_HEIGHT
+#define TARGET_CHAR_HEIGHT 160 /* これより高い入力画像は縮小する */
+#endif
+
+/*
+ * width x heightの入力を縮小した大きさを*dst_width, *dst_heightに求める
+ * (縮小が要らなければ0を返し、元の大きさを入れる)
+ */
+static inline int
+downscale_size(int width, int height, int* dst_width, int* dst_height)
+{
+    *dst_width = width;
+    *dst_height = height;
+    if (height <= TARGET_CHAR_HEIGHT) {
+        return 0;
+    }
+    *dst_width = (int)((double)width * TARGET_CHAR_HEIGHT / height + 0.5);
+    if (*dst_width < 1) {
+        *dst_width = 1;
+    }
+    *dst_height = TARGET_CHAR_HEIGHT;
+    return 1;
+}
+
+#endif /* DOWNSCALE_H */
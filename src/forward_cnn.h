@@ -202,6 +202,28 @@ public:
         }
     }
 
+    // computes only the outputs whose mask is true (the others are 0)
+    void
+    forward(Tensor<float>& input, std::vector<bool>& mask)
+    {
+        assert(input.shape.size() == 2 && input.shape[1] == n_in);
+        assert(mask.size() == n_out);
+        int n = input.shape[0];
+        output = Tensor<float>(n, n_out);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n_out; j++) {
+                if (!mask[j]) {
+                    continue;
+                }
+                float sum = b.at(j);
+                for (int k = 0; k < n_in; k++) {
+                    sum += input.at(i, k) * W.at(k, j);
+                }
+                output.at(i, j) = sum;
+            }
+        }
+    }
+
     virtual void
     load_weights(std::ifstream& ifs)
     {
@@ -478,6 +500,35 @@ public:
             }
         }
     }
+
+    // normalizes over the outputs whose mask is true (the others are 0)
+    void
+    forward(Tensor<float>& input, std::vector<bool>& mask)
+    {
+        assert(input.shape.size() == 2 && mask.size() == input.shape[1]);
+        output = Tensor<float>(input.shape);
+        for (int i = 0; i < input.shape[0]; i++) {
+            float max_v = -INFINITY;
+            for (int j = 0; j < input.shape[1]; j++) {
+                if (mask[j]) {
+                    max_v = std::max(max_v, input.at(i, j));
+                }
+            }
+            float sum_v = 0;
+            for (int j = 0; j < input.shape[1]; j++) {
+                if (mask[j]) {
+                    output.at(i, j) = std::exp(input.at(i, j) - max_v);
+                    sum_v += output.at(i, j);
+                }
+            }
+            if (sum_v == 0) {
+                continue;
+            }
+            for (int j = 0; j < input.shape[1]; j++) {
+                output.at(i, j) /= sum_v;
+            }
+        }
+    }
 };
 
 class Network {
@@ -542,17 +593,61 @@ public:
         return layers[layers.size() - 1]->output;
     }
 
+    // restricts the output to the classes whose mask is true.
+    // when the network ends with Dense and Softmax, only the needed rows
+    // of the last Dense layer are computed.
+    Tensor<float>
+    predict(Tensor<float>& X, std::vector<bool>& mask)
+    {
+        int      last = layers.size() - 1;
+        Dense*   dense = last > 0 ? dynamic_cast<Dense*>(layers[last - 1]) : NULL;
+        Softmax* softmax = dynamic_cast<Softmax*>(layers[last]);
+
+        if (dense == NULL || softmax == NULL) {
+            Tensor<float> pred = predict(X);
+            for (int i = 0; i < pred.shape[0]; i++) {
+                for (int j = 0; j < pred.shape[1]; j++) {
+                    if (!mask[j]) {
+                        pred.at(i, j) = 0;
+                    }
+                }
+            }
+            return pred;
+        }
+
+        Tensor<float>* input = &X;
+        for (int i = 0; i < last - 1; i++) {
+            layers[i]->forward(*input);
+            input = &layers[i]->output;
+        }
+        dense->forward(*input, mask);
+        softmax->forward(dense->output, mask);
+        return softmax->output;
+    }
+
     std::vector<int>
     predict_classes(Tensor<float>& X)
+    {
+        std::vector<bool> mask;
+        return predict_classes(X, mask);
+    }
+
+    // an empty mask means no restriction.
+    // returns -1 if no class is allowed.
+    std::vector<int>
+    predict_classes(Tensor<float>& X, std::vector<bool>& mask)
     {
         int              n = X.shape[0];
-        Tensor<float>    pred = predict(X);
+        Tensor<float>    pred = mask.empty() ? predict(X) : predict(X, mask);
         std::vector<int> label(n);
         for (int i = 0; i < n; i++) {
-            int   max_idx = 0;
-            float max_value = pred.at(i, 0);
-            for (int j = 1; j < pred.shape[1]; j++) {
-                if (max_value < pred.at(i, j)) {
+            int   max_idx = -1;
+            float max_value = 0;
+            for (int j = 0; j < pred.shape[1]; j++) {
+                if (!mask.empty() && !mask[j]) {
+                    continue;
+                }
+                if (max_idx < 0 || max_value < pred.at(i, j)) {
                     max_idx = j;
                     max_value = pred.at(i, j);
                 }
@@ -564,12 +659,21 @@ public:
 
     std::vector<std::string>
     predict_labels(Tensor<float>& X)
+    {
+        std::vector<bool> mask;
+        return predict_labels(X, mask);
+    }
+
+    std::vector<std::string>
+    predict_labels(Tensor<float>& X, std::vector<bool>& mask)
     {
         assert(label_set);
-        std::vector<int>         classes = predict_classes(X);
+        std::vector<int>         classes = predict_classes(X, mask);
         std::vector<std::string> ret_labels(classes.size());
         for (int i = 0; i < classes.size(); i++) {
-            ret_labels[i] = labels[classes[i]];
+            if (classes[i] >= 0) {
+                ret_labels[i] = labels[classes[i]];
+            }
         }
         return ret_labels;
     }
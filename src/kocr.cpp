@@ -29,13 +29,18 @@
 #define _WITH_GETLINE
 #define _KOCR_MAIN
 
+#include <errno.h>
 #include <math.h>
 #include <search.h> // for qsort
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -58,14 +63,77 @@
  * static functions
  */
 #ifdef USE_SVM
-static char* recog_image(CvSVM*, IplImage*);
+static char* recog_image(CvSVM*, IplImage*, const char*, int);
+static char* recog_file(CvSVM*, char*, const char*, int);
 #else
-static char* recog_image(feature_db*, IplImage*);
+static char* recog_image(feature_db*, IplImage*, const char*, int);
+static char* recog_file(feature_db*, char*, const char*, int);
 #endif
 
 static void exclude(feature_db* db, char* lst_name);
 static void distance(feature_db* db, char* lst_name);
 static void average(feature_db* db, char* lst_name);
+static void soak(feature_db* db, char* lst_name, int count);
+static void recall(feature_db* db);
+static void knn_bench(feature_db* db);
+static feature_db* condense(feature_db* db);
+static feature_db* prototype(feature_db* db, int m, char* use);
+static void        prototype_bench(feature_db* db);
+
+/*
+ * 最近傍探索用の問い合わせ
+ */
+typedef struct {
+    DIRP (*target)[N][N];       // 検索対象の特徴
+    DIRP_S      summary;        // 検索対象の低解像度特徴
+    double      pdist[NPIVOTS]; // 検索対象から各ピボットへの距離
+    int         skip;           // 検索から除外するエントリ (-1なら除外なし)
+    const char* charset;        // 認識対象の文字 (NULLなら全て)
+    int         min_char_data;  // 最近傍のエントリ
+    double      min_dist;       // 最近傍までの距離
+    int         k;              // 求める近傍の数
+    int         nknn;           // 求まった近傍の数
+    int         knn_n[NN_MAX_K]; // 近傍のエントリ (最も遠いものが先頭のヒープ)
+    double      knn_d[NN_MAX_K]; // 近傍までの距離
+    double      limit;          // 枝刈りに用いる距離 (k番目の近傍までの距離)
+    int         n_evals;        // DIRP_Distを計算したエントリ数
+} nn_query;
+
+static int  nn_cpus();
+static void nn_query_init(nn_query*, DIRP (*)[N][N], int, const char*, int);
+static void nn_search(feature_db*, nn_query*);
+static void nn_search_batch(feature_db*, nn_query*, int);
+static void nn_search_exhaustive(feature_db*, nn_query*);
+#ifndef LIBRARY
+static double nn_credibility(feature_db*, nn_query*, double);
+#endif
+static void nn_all_pairs(feature_db*, int*, double*, unsigned short*, double);
+
+/*
+ * 全エントリ間の距離のキャッシュ
+ */
+typedef struct {
+    int          magic;    // DIST_CACHE_MAGIC
+    unsigned int hash;     // 特徴量のハッシュ (db_hash)
+    int          nitems;   // エントリ数
+    int          channels; // 距離計算に用いる方向特徴の数
+    int          tile;     // タイルの一辺 (NN_TILE)
+    int          complete; // 書き込みが完了していれば真
+    double       step;     // 量子化の幅
+} dist_cache_header;
+
+typedef struct {
+    dist_cache_header* header;
+    unsigned short*    tiles;
+    size_t             length;
+    int                mapped; // mmapした領域か
+    int                ntiles;
+} dist_cache;
+
+static dist_cache* dist_cache_open(feature_db*);
+static void        dist_cache_close(dist_cache*);
+static int dist_cache_nearest(dist_cache*, feature_db*, int, int*, int, double*);
+static void dist_cache_all_nearest(dist_cache*, feature_db*, int*, double*);
 
 /* ============================================================*
  * トレーニング用関数
@@ -117,6 +185,171 @@ static void average(feature_db* db, char* lst_name);
  *                       (標準パタン完成)
  *
  * ============================================================*/
+#ifdef THINNING
+/*
+ * 細線化版で学習に用いる傾き補正の方法 (環境変数KOCR_DESKEWにnone,
+ * rotate, shearのいずれかで指定できる)。指定が無ければfallbackを、
+ * 不正な名前なら-1を返す。
+ */
+static int
+deskew_mode(int fallback)
+{
+    const char* env = getenv("KOCR_DESKEW");
+    int         d;
+
+    if (env == NULL || *env == '\0') {
+        return fallback;
+    }
+    for (d = DESKEW_NONE; d <= DESKEW_SHEAR; d++) {
+        if (!strcmp(env, db_deskew_name(d))) {
+            return d;
+        }
+    }
+    return -1;
+}
+
+// 認識に用いる傾き補正の方法 (データベースを作成したときのもの)
+#ifdef USE_SVM
+#define DB_DESKEW(db) DESKEW_ROTATE /* SVMのモデルには記録していない */
+#else
+#define DB_DESKEW(db) ((db)->deskew)
+#endif
+#endif
+
+/*
+ * 特徴抽出のワーカ
+ *
+ * 細線化によらない特徴抽出は作業領域をスレッドごとに持つので並列に行う。
+ * 細線化による特徴抽出 (thinning.cpp) はファイル内の変数を共有するので
+ * 1スレッドで行う。
+ */
+typedef struct {
+    char**  names;     // 画像ファイル名 (NULLなら特徴抽出しない)
+    DIRP*** char_data; // 特徴量の格納先
+    int     nitems;
+    int     part;
+    int     nparts;
+    int     deskew; // 細線化版の傾き補正の方法 (DESKEW_*)
+    int     status; // 作業領域を確保できなければ-1
+} training_worker;
+
+static void*
+training_main(void* arg)
+{
+    training_worker* w = (training_worker*)arg;
+    int              i, j, n, d;
+#ifdef THINNING
+    int features[N][N][ANGLES];
+#else
+    feature_ctx* ctx = (feature_ctx*)calloc(1, sizeof(feature_ctx));
+    datafolder*  df; // 特徴量保存領域 (ctx内)
+
+    if (ctx == NULL) {
+        w->status = -1;
+        return NULL;
+    }
+#endif
+
+    for (n = w->part; n < w->nitems; n += w->nparts) {
+        if (w->names[n] == NULL) {
+            continue;
+        }
+#ifdef THINNING
+        Extract_Feature_wrapper_deskew(w->names[n], features, w->deskew);
+        for (i = 0; i < N; i++) {
+            for (j = 0; j < N; j++) {
+                for (d = 0; d < ANGLES; d++) {
+                    w->char_data[n][j][i].d[d] = features[j][i][d];
+                }
+                w->char_data[n][j][i].I = 0;
+            }
+        }
+#else
+        extract_feature_wrapper_r(ctx, w->names[n], &df);
+        // Extract_Feature内のMake_Intensityでdf->Data[][].I,
+        // Equalize_Directional_Patternでdf->Data[][].d[]を書き換えている
+        if (df->status) {
+            // Extract_Featureが正しく終了したとき、status=0、失敗は-1
+            continue;
+        }
+
+        // char_dataに保存
+        for (i = 0; i < Y_SIZE; i++) {
+            for (j = 0; j < X_SIZE; j++) {
+                for (d = 0; d < 4; d++) {
+                    w->char_data[n][i][j].d[d] = df->Data[i][j].d[d];
+                }
+                w->char_data[n][i][j].I = df->Data[i][j].I;
+            }
+        }
+#endif
+    }
+
+#ifndef THINNING
+    feature_ctx_finish(ctx);
+    free(ctx);
+#endif
+    return NULL;
+}
+
+/*
+ * 画像ごとの特徴量の領域 (char_data) を解放する
+ */
+static void
+free_char_data(DIRP*** char_data, int num_of_char)
+{
+    int i, n;
+
+    for (n = 0; n < num_of_char; n++) {
+        if (char_data[n] == NULL) {
+            continue;
+        }
+        for (i = 0; i < X_SIZE; i++) {
+            if (char_data[n][i] != NULL) {
+                free(char_data[n][i]);
+            }
+        }
+        free(char_data[n]);
+    }
+    free(char_data);
+}
+
+/*
+ * 画像リストの1行 (line_buf) から画像のファイル名とクラスを取り出す
+ *
+ * ファイル名をtarget_dirからのパスとしてpathに格納し、クラスを返す。
+ * 書式が正しくなければ0を返す。line_bufは書き換える。
+ */
+static int
+list_entry(char* line_buf, const char* target_dir, char* path)
+{
+    char* p;
+    int   c;
+
+    // 末尾の改行文字を終端文字に置き換える
+    p = strchr(line_buf, '\n');
+    if (p != NULL) {
+        *p = '\0';
+    }
+
+    p = strrchr(line_buf, ' ');
+    if (!p && line_buf[1] == '-') {
+        // kocr形式: ファイル名の先頭がクラス
+        c = line_buf[0];
+    } else if (p && isprint(*(p + 1))) {
+        // gocr形式: ファイル名とクラスをスペースで区切る
+        *p = '\0';
+        c = *(p + 1);
+    } else {
+        return 0;
+    }
+    // int sprintf(char *str,const char *format, ...):
+    // 書式formatにしたがって、printfと同様の出力を、
+    // 文字列strに格納
+    sprintf(path, "%s/%s", target_dir, line_buf);
+    return c;
+}
+
 /*
  * データベース作成関数
  */
@@ -134,18 +367,18 @@ training(char* list_file)
     int            i, j, k, cc, n, m, d;
     int            num_of_char = 0; // 画像数
     char           line_buf[300];
+    char           meta[300]; // データベースに記録する作成元
     FILE*          listfile;
     LabelingBS     labeling; // 使ってない
-    char* class_data; // データベース上の保存場所（ポインタ）
     char* target_dir;
     DIRP***     char_data; // 画像ごとに、16*16のbyte領域を確保
     char*       Class;     // Class[num_of_char]:画像のクラスを保存
-    datafolder* df;        // 特徴量保存領域
 
-#ifdef THINNING
-    int features[N][N][ANGLES];
-    // int features[N][N];
-#endif
+    char**           names; // names[num_of_char]:画像ファイル名
+    training_worker* workers;
+    pthread_t*       threads;
+    int              t, nthreads, failed;
+    int              deskew = DESKEW_DEFAULT; // 傾き補正の方法
 
 #ifdef USE_SVM
     CvSVM          svm, *svm_;
@@ -158,6 +391,15 @@ training(char* list_file)
     }
 #endif
 
+#if defined(THINNING) && !defined(USE_SVM)
+    // SVMのモデルには傾き補正の方法を記録できないので既定のものに限る
+    if ((deskew = deskew_mode(DESKEW_DEFAULT)) < 0) {
+        printf("invalid KOCR_DESKEW: %s (none, rotate or shear)\n",
+               getenv("KOCR_DESKEW"));
+        return NULL;
+    }
+#endif
+
     if ((listfile = fopen(list_file, "rt")) == (FILE*)NULL) {
         printf("image list file is not found. aborting...\n");
 
@@ -212,6 +454,7 @@ training(char* list_file)
 
     // 全文字データ格納領域確保
     Class = (char*)malloc(sizeof(char) * num_of_char);
+    names = (char**)calloc(num_of_char, sizeof(char*));
     // char_data[num_of_char(画像数)][Y_SIZE(16)][X_SIZE(16)](Nはピクセル数)
 
     char_data = (DIRP***)malloc(sizeof(DIRP**) * num_of_char);
@@ -238,104 +481,86 @@ training(char* list_file)
     // ファイル位置指示子を先頭に戻し、エラー指示子と終端指示子をクリアする
     rewind(listfile);
     while (fgets(line_buf, sizeof(line_buf), listfile) != NULL) {
-        char  char_file_name[400];
-        char* p;
-
-        // 末尾の改行文字を終端文字に置き換える
-        p = strchr(line_buf, '\n');
-        if (p != NULL) {
-            *p = '\0';
-        }
+        char char_file_name[400];
 
         // ファイルフォーマットの確認
-        p = strrchr(line_buf, ' ');
-        if (!p && line_buf[1] == '-') {
-            // 画像のクラスを保存
-            Class[n] = line_buf[0];
-#ifdef USE_SVM
-            char_count[line_buf[0]]++;
-#endif
-            // int sprintf(char *str,const char *format, ...):
-            // 書式formatにしたがって、printfと同様の出力を、
-            // 文字列strに格納
-            sprintf(char_file_name, "%s/%s", target_dir, line_buf);
-        } else if (p && isprint(*(p + 1))) {
-            // int isprint(int c):cが表示文字であれば真を返す
-            *p = '\0';
-            Class[n] = *(p + 1);
-            sprintf(char_file_name, "%s/%s", target_dir, line_buf);
-        } else {
+        Class[n] = list_entry(line_buf, target_dir, char_file_name);
+        if (!Class[n]) {
             Class[n] = '0';
             n++;
             continue;
         }
+#ifdef USE_SVM
+        char_count[(unsigned char)Class[n]]++;
+#endif
+
+        names[n] = strdup(char_file_name);
+        n++;
+    }
+    fclose(listfile);
 
+    //
+    // 特徴抽出
+    //
 #ifdef THINNING
-        Extract_Feature_wrapper(char_file_name, features);
-        for (i = 0; i < N; i++) {
-            // printf("%3d ", i);
-            for (j = 0; j < N; j++) {
-                // char_data[n][j][i].d[0] = (uchar) features[j][i];
-                // printf("%3d,", char_data[n][j][i].d[0]);
-                for (d = 0; d < ANGLES; d++) {
-                    char_data[n][j][i].d[d] = features[j][i][d];
-                    // printf("[%d]", char_data[i][k][j].d[d]);
-                }
-                char_data[n][j][i].I = 0;
-            }
-            // printf("\n");
-        }
+    nthreads = 1;
 #else
-        extract_feature_wrapper(char_file_name, &df);
-        // subr.cpp内で宣言 (特徴量をdfに保存)
-        // Extract_Feature内のMake_Intensityでdf->Data[][].I,
-        // Equalize_Directional_Patternでdf->Data[][].d[]を書き換えている
-        if (df->status) {
-            // Extract_Featureが正しく終了したとき、status=0、失敗は-1
-            n++;
-            continue;
+    nthreads = MIN(nn_cpus(), MAX(1, n));
+#endif
+    workers = (training_worker*)malloc(sizeof(training_worker) * nthreads);
+    threads = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
+    for (t = 0; t < nthreads; t++) {
+        workers[t].names = names;
+        workers[t].char_data = char_data;
+        workers[t].nitems = n;
+        workers[t].part = t;
+        workers[t].nparts = nthreads;
+        workers[t].deskew = deskew;
+        workers[t].status = 0;
+    }
+    for (t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, training_main, &workers[t])) {
+            // スレッドを作れなければ、後でこのスレッドで抽出する
+            workers[t].names = NULL;
         }
-
-        // char_dataに保存
-        for (i = 0; i < Y_SIZE; i++) {
-            for (j = 0; j < X_SIZE; j++) {
-                for (d = 0; d < 4; d++) {
-                    char_data[n][i][j].d[d] = df->Data[i][j].d[d];
-                }
-                char_data[n][i][j].I = df->Data[i][j].I;
-            }
+    }
+    training_main(&workers[0]);
+    for (t = 1; t < nthreads; t++) {
+        if (workers[t].names) {
+            pthread_join(threads[t], NULL);
+        } else {
+            workers[t].names = names;
+            training_main(&workers[t]);
         }
-#endif
-
-        n++;
+    }
+    for (t = 0, failed = 0; t < nthreads; t++) {
+        failed |= workers[t].status;
+    }
+    free(workers);
+    free(threads);
+    for (i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+    if (failed) {
+        printf("cannot allocate the work area. aborting...\n");
+        free_char_data(char_data, num_of_char);
+        free(Class);
+        return NULL;
     }
     printf("extraction completed...\n");
-    fclose(listfile);
 
     //
     // 全特徴情報のパッキング
     //
-    feature_db* db = (feature_db*)malloc(sizeof(feature_db)
-                                         + sizeof(DIRP[Y_SIZE][X_SIZE]) * n
-                                         + sizeof(char) * n);
-    db->magic = MAGIC_NO;
-    db->nitems = num_of_char = n;
-    db->feature_offset = sizeof(feature_db);
-    db->class_offset = sizeof(feature_db) + sizeof(DIRP[Y_SIZE][X_SIZE]) * n;
-
-    /*
-     * db->mem_size =  sizeof(feature_db) + sizeof(DIRP[Y_SIZE][X_SIZE]) * n +
-     * sizeof(char) * num_of_char;
-     */
+    num_of_char = n;
 
     // feature_dataの宣言
     DIRP(*feature_data)
     [Y_SIZE][X_SIZE];
 
-    // dbの特徴量の先頭アドレス
-    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + sizeof(*db));
-    // dbのクラスの先頭アドレス
-    class_data = (char*)db + sizeof(*db) + sizeof(DIRP[Y_SIZE][X_SIZE]) * n;
+    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])calloc(
+        num_of_char, sizeof(DIRP[Y_SIZE][X_SIZE]));
 
     for (n = 0; n < num_of_char; n++) {
         for (i = 0; i < Y_SIZE; i++) {
@@ -345,20 +570,24 @@ training(char* list_file)
                 [Y_SIZE][X_SIZE] = &feature_data[n];
 
                 B[0][i][j].I = A[i][j].I;
-                B[0][i][j].d[0] = A[i][j].d[0];
-                B[0][i][j].d[1] = A[i][j].d[1];
-                B[0][i][j].d[2] = A[i][j].d[2];
-                B[0][i][j].d[3] = A[i][j].d[3];
+                for (d = 0; d < CHANNELS; d++) {
+                    B[0][i][j].d[d] = A[i][j].d[d];
+                }
             }
         }
     }
 
-    for (n = 0; n < num_of_char; n++) {
-        // データベース上のイメージの保存場所にクラスを保存
-        class_data[n] = Class[n];
-    }
+    // 低解像度特徴などの補助情報と共にパッキング
+    snprintf(meta, sizeof(meta), "source=%s", list_file);
+    feature_db* db
+        = db_pack(feature_data, Class, num_of_char, CHANNELS, deskew, meta);
+    free(feature_data);
 
 #ifdef USE_SVM
+    // dbの特徴量の先頭アドレス
+    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
+    // dbのクラスの先頭アドレス
+    char* class_data = (char*)db + db->class_offset;
 
     for (class_count = 0, i = 0; i < 256; i++)
         if (char_count[i] > 0) {
@@ -396,11 +625,12 @@ training(char* list_file)
 #ifdef THINNING
         for (j = 0; j < N; ++j) {
             for (k = 0; k < N; ++k) {
+                // class_dataと同じくdb_packで並べ替えた後の特徴量を用いる
                 for (int kk = 0; kk < ANGLES; ++kk) {
                     cvmSet(Direction,
                            i,
                            j * N * ANGLES + k * ANGLES + kk,
-                           char_data[i][k][j].d[kk]);
+                           feature_data[i][k][j].d[kk]);
                 }
 #else
         for (j = 0; j < Y_SIZE; ++j) {
@@ -454,18 +684,7 @@ training(char* list_file)
     /*
      * mallocした領域を解放する
      */
-    for (n = 0; n < num_of_char; n++) {
-        if (char_data[n] == NULL) {
-            continue;
-        }
-        for (i = 0; i < X_SIZE; i++) {
-            if (char_data[n][i] != NULL) {
-                free(char_data[n][i]);
-            }
-        }
-        free(char_data[n]);
-    }
-    free(char_data);
+    free_char_data(char_data, num_of_char);
     free(Class);
 
 #ifdef USE_SVM
@@ -486,13 +705,18 @@ void
 leave_one_out_test(feature_db* db)
 #endif
 {
-    double min_dist, dist; //最近傍法用の距離計算
     int    min_char_data;
-    int    i, j, n, m;
+    int    i, j, n;
     int    correct = 0;
     int    miss = 0;
     int    nitems;
     char   file_num[300];
+#ifndef USE_SVM
+    int *       order, *index, *nearest;
+    int         k;
+    double*     near_d;
+    dist_cache* cache;
+#endif
 
     IplImage* miss_recog;
     DIRP(*feature_data)
@@ -604,19 +828,24 @@ leave_one_out_test(feature_db* db)
     }
 
 #else /* USE_SVM */
+    // 画像リストの順に処理する
+    order = (int*)((char*)db + db->order_offset);
+    index = (int*)malloc(sizeof(int) * nitems);
     for (n = 0; n < nitems; n++) {
-        // float
-        min_char_data = -1;
-        min_dist = 1e10;
-        // 最近傍検索ループ
-        for (m = 0; m < nitems; m++) {
-            if (m != n) {
-                dist = DIRP_Dist(&feature_data[n], &feature_data[m]);
-                if (dist < min_dist) {
-                    min_dist = dist;
-                    min_char_data = m;
-                }
-            }
+        index[order[n]] = n;
+    }
+
+    // 全エントリ間の距離はキャッシュから求める
+    cache = dist_cache_open(db);
+    nearest = (int*)malloc(sizeof(int) * nitems);
+    near_d = (double*)malloc(sizeof(double) * nitems);
+    dist_cache_all_nearest(cache, db, nearest, near_d);
+
+    for (k = 0; k < nitems; k++) {
+        n = index[k];
+        min_char_data = nearest[n];
+        if (min_char_data < 0) {
+            continue;
         }
 
         // printf("%c   %c\n", class_data[n], class_data[min_char_data]);
@@ -642,9 +871,9 @@ leave_one_out_test(feature_db* db)
                     ERR_DIR,
                     miss,
                     class_data[n],
-                    n,
+                    order[n],
                     class_data[(int)min_char_data],
-                    (int)min_char_data);
+                    order[min_char_data]);
             printf("miss image : %s\n", file_num);
             try {
                 cvSaveImage(file_num, miss_recog);
@@ -654,6 +883,10 @@ leave_one_out_test(feature_db* db)
             }
         }
     }
+    free(index);
+    free(nearest);
+    free(near_d);
+    dist_cache_close(cache);
 #endif
 
     printf("Recog-rate = %g (= %d / %d )\n",
@@ -667,75 +900,1343 @@ leave_one_out_test(feature_db* db)
 }
 
 /* ============================================================
- * 文字認識用ドライバ
+ * 最近傍探索
  * ============================================================ */
-char*
-#ifdef USE_SVM
-recognize(CvSVM* db, IplImage* src_img)
-#else
-recognize(feature_db* db, IplImage* src_img)
-#endif
+typedef struct {
+    double bound;
+    int    n;
+} nn_candidate;
+
+static int
+compare_candidate(const void* a, const void* b)
 {
-    double min_dist, dist;
-    int    min_char_data;
-    int    n, nitems;
-    int    i, j, d;
-    char   result[2];
+    const nn_candidate* A = (const nn_candidate*)a;
+    const nn_candidate* B = (const nn_candidate*)b;
 
-    char*  class_data;
-    double total = 0;
-    DIRP   target_data[Y_SIZE][X_SIZE];
+    if (A->bound != B->bound) {
+        return A->bound > B->bound ? 1 : -1;
+    }
+    return A->n - B->n;
+}
 
-#ifdef THINNING
-    int features[N][N][ANGLES];
+static void
+nn_query_init(nn_query*   q,
+              DIRP (*target)[N][N],
+              int         skip,
+              const char* charset,
+              int         k)
+{
+    q->target = target;
+    DIRP_Summarize(target, &q->summary);
+    q->skip = skip;
+    q->charset = charset;
+    q->min_char_data = -1;
+    q->min_dist = 1e10;
+    q->k = MAX(1, MIN(k, NN_MAX_K));
+    q->nknn = 0;
+    q->limit = 1e10;
+    q->n_evals = 0;
+}
 
-    if (Extract_Feature(cv::cvarrToMat(src_img, true), features)) {
-        return 0;
-    }
+/*
+ * 認識対象の文字か
+ */
+static int
+in_charset(const char* charset, int c)
+{
+    return charset == NULL || (c != 0 && strchr(charset, c) != NULL);
+}
 
-    CvMat* feature_mat = cvCreateMat(1, N * N * ANGLES, CV_32FC1);
-    for (i = 0; i < N; i++) {
-        for (j = 0; j < N; j++) {
-            for (int k = 0; k < ANGLES; k++) {
-                cvmSet(feature_mat,
-                       0,
-                       i * N * ANGLES + j * ANGLES + k,
-                       features[j][i][k]);
-            }
-        }
-    }
+/*
+ * 近傍の比較 (同距離の場合は画像リスト上の順番が早い方を近いとする)
+ */
+static int
+nn_farther(int* order, int n, double dist, int m, double mdist)
+{
+    return dist > mdist || (dist == mdist && order[n] > order[m]);
+}
 
-#else
-    DIRP(*feature_data)
-    [Y_SIZE][X_SIZE];
-    datafolder* df;
+/*
+ * 最近傍とk近傍の更新
+ *
+ * k近傍は、最も遠いものを先頭に置く大きさkのヒープで保持する。同距離の
+ * 場合は画像リスト上の順番が早い方を採る (並べ替え前の全探索と同じ結果)。
+ */
+static void
+nn_update(nn_query* q, int* order, int n, double dist)
+{
+    int i, j, t;
 
-    //
-    // 特徴抽出
-    //
-    extract_feature(src_img, &df);
-    if (df->status) {
-        // 特徴抽出失敗で真
-        return 0;
+    if (q->min_char_data < 0
+        || nn_farther(order, q->min_char_data, q->min_dist, n, dist)) {
+        q->min_dist = dist;
+        q->min_char_data = n;
+    }
+    if (q->k <= 1) {
+        q->limit = q->min_dist;
+        return;
     }
 
-    for (i = 0; i < Y_SIZE; i++) {
-        for (j = 0; j < X_SIZE; j++) {
-            for (d = 0; d < 4; d++) {
-                target_data[i][j].d[d] = df->Data[i][j].d[d];
+    for (i = 0; i < q->nknn; i++) {
+        if (q->knn_n[i] == n) {
+            // 登録済み (並列探索の結果をまとめるとき)
+            return;
+        }
+    }
+    if (q->nknn < q->k) {
+        // 末尾に追加して上へ移動
+        i = q->nknn++;
+        while (i > 0) {
+            j = (i - 1) / 2;
+            if (!nn_farther(order, n, dist, q->knn_n[j], q->knn_d[j])) {
+                break;
             }
-            target_data[i][j].I = df->Data[i][j].I;
+            q->knn_n[i] = q->knn_n[j];
+            q->knn_d[i] = q->knn_d[j];
+            i = j;
+        }
+    } else if (nn_farther(order, q->knn_n[0], q->knn_d[0], n, dist)) {
+        // 先頭を置き換えて下へ移動
+        i = 0;
+        while ((j = 2 * i + 1) < q->nknn) {
+            t = j + 1;
+            if (t < q->nknn
+                && nn_farther(order, q->knn_n[t], q->knn_d[t], q->knn_n[j],
+                              q->knn_d[j])) {
+                j = t;
+            }
+            if (!nn_farther(order, q->knn_n[j], q->knn_d[j], n, dist)) {
+                break;
+            }
+            q->knn_n[i] = q->knn_n[j];
+            q->knn_d[i] = q->knn_d[j];
+            i = j;
         }
+    } else {
+        return;
     }
-#endif
+    q->knn_n[i] = n;
+    q->knn_d[i] = dist;
 
-#ifdef USE_SVM
+    q->limit = q->nknn < q->k ? 1e10 : q->knn_d[0];
+}
 
-#ifdef THINNING
-    char response = (char)db->predict(feature_mat);
-#else
-    /* data packing and recognization */
-    int  kk;
+/*
+ * k近傍の距離重み付き投票
+ *
+ * 各近傍は1 / (距離 + 1) の重みで自身のクラスに投票する。最も得票の多い
+ * クラスの中で最も近いエントリを返し、その距離をdistに入れる。同点なら
+ * 最近傍のクラスを採る。
+ */
+static int
+nn_vote(feature_db* db, nn_query* q, double* dist)
+{
+    char*  class_data;
+    int*   order;
+    double votes[256];
+    double best_dist;
+    int    i, c, n, best, best_class;
+
+    if (q->k <= 1 || q->nknn == 0) {
+        *dist = q->min_dist;
+        return q->min_char_data;
+    }
+    class_data = (char*)db + db->class_offset;
+    order = (int*)((char*)db + db->order_offset);
+
+    memset(votes, 0, sizeof(votes));
+    for (i = 0; i < q->nknn; i++) {
+        c = (unsigned char)class_data[q->knn_n[i]];
+        votes[c] += 1.0 / (q->knn_d[i] + 1);
+    }
+    best_class = (unsigned char)class_data[q->min_char_data];
+    for (c = 0; c < 256; c++) {
+        if (votes[c] > votes[best_class]) {
+            best_class = c;
+        }
+    }
+
+    best = -1;
+    best_dist = 1e10;
+    for (i = 0; i < q->nknn; i++) {
+        n = q->knn_n[i];
+        if ((unsigned char)class_data[n] != best_class) {
+            continue;
+        }
+        if (best < 0 || nn_farther(order, best, best_dist, n, q->knn_d[i])) {
+            best = n;
+            best_dist = q->knn_d[i];
+        }
+    }
+    *dist = best_dist;
+    return best;
+}
+
+/*
+ * 近傍の数 (0以下ならデータベースの設定に従う)
+ */
+static int
+nn_k(feature_db* db, int k)
+{
+    if (k > 0) {
+        return k;
+    }
+    return db->knn > 0 ? db->knn : 1;
+}
+
+/*
+ * クラス内の探索
+ *
+ * 重心に近いクラスから順に、各クラスのエントリのうちnparts等分した
+ * part番目の範囲を探索する。クラス内では三角不等式と低解像度特徴による
+ * 下界の小さい順にDIRP_Distを計算し、下界が暫定の最小距離を超えた時点で
+ * 打ち切る。is_pivotはnn_pivot_flagsで求めたピボットの印。
+ */
+static void
+nn_scan(feature_db*          db,
+        nn_query*            q,
+        nn_candidate*        ccand,
+        int                  nccand,
+        const unsigned char* is_pivot,
+        int                  part,
+        int                  nparts)
+{
+    DIRP(*feature_data)
+    [N][N];
+    DIRP_S*       summary_data;
+    class_info*   cinfo;
+    int*          order;
+    double*       pdist;
+    nn_candidate* cand;
+    int           c, n, m, p, ncand, lo, hi;
+    double        dist, bound;
+    dist_func     dist_f = db_dist(db);
+
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    summary_data = (DIRP_S*)((char*)db + db->summary_offset);
+    cinfo = (class_info*)((char*)db + db->cinfo_offset);
+    order = (int*)((char*)db + db->order_offset);
+    pdist = (double*)((char*)db + db->pdist_offset);
+
+    cand = (nn_candidate*)malloc(sizeof(nn_candidate) * db->nitems);
+    for (c = 0; c < nccand; c++) {
+        class_info* ci = &cinfo[ccand[c].n];
+
+        if (ccand[c].bound > q->limit) {
+            // 残りのクラスは下界の小さい順に並んでいるので打ち切る
+            break;
+        }
+
+        lo = ci->start + (long)ci->count * part / nparts;
+        hi = ci->start + (long)ci->count * (part + 1) / nparts;
+        ncand = 0;
+        for (n = lo; n < hi; n++) {
+            if (n == q->skip || is_pivot[n]) {
+                // ピボットは計算済み
+                continue;
+            }
+
+            // 三角不等式による下界 |d(q, p) - d(x, p)| <= d(q, x)
+            bound = ccand[c].bound;
+            for (p = 0; p < db->npivots; p++) {
+                dist = ABS(q->pdist[p] - pdist[n * db->npivots + p]);
+                bound = MAX(bound, dist - DIST_EPS);
+            }
+            if (bound <= q->limit) {
+                bound = MAX(bound, DIRP_Bound(&q->summary, &summary_data[n]));
+            }
+            if (bound > q->limit) {
+                continue;
+            }
+
+            cand[ncand].bound = bound;
+            cand[ncand].n = n;
+            ncand++;
+        }
+        qsort(cand, ncand, sizeof(nn_candidate), compare_candidate);
+
+        for (m = 0; m < ncand; m++) {
+            if (cand[m].bound > q->limit) {
+                break;
+            }
+            n = cand[m].n;
+            dist = dist_f(&feature_data[n], q->target);
+            q->n_evals++;
+            nn_update(q, order, n, dist);
+        }
+    }
+
+    free(cand);
+}
+
+/*
+ * 並列探索のワーカ
+ */
+typedef struct {
+    feature_db*          db;
+    nn_query             q; // 暫定の最近傍はワーカごとに持つ
+    nn_candidate*        ccand;
+    int                  nccand;
+    const unsigned char* is_pivot;
+    int                  part;
+    int                  nparts;
+} nn_worker;
+
+static void*
+nn_worker_main(void* arg)
+{
+    nn_worker* w = (nn_worker*)arg;
+
+    nn_scan(w->db,
+            &w->q,
+            w->ccand,
+            w->nccand,
+            w->is_pivot,
+            w->part,
+            w->nparts);
+    return NULL;
+}
+
+/*
+ * ワーカが求めた近傍をqにまとめる
+ */
+static void
+nn_merge(nn_query* q, int* order, nn_query* w)
+{
+    int i;
+
+    q->n_evals += w->n_evals;
+    if (w->min_char_data >= 0) {
+        nn_update(q, order, w->min_char_data, w->min_dist);
+    }
+    for (i = 0; i < w->nknn; i++) {
+        nn_update(q, order, w->knn_n[i], w->knn_d[i]);
+    }
+}
+
+/*
+ * エントリごとのピボットの印 (探索の間だけ使う)
+ */
+static unsigned char*
+nn_pivot_flags(feature_db* db)
+{
+    unsigned char* is_pivot;
+    int*           pivots;
+    int            p;
+
+    pivots = (int*)((char*)db + db->pivot_offset);
+    is_pivot = (unsigned char*)calloc(db->nitems, 1);
+    if (is_pivot == NULL) {
+        return NULL;
+    }
+    for (p = 0; p < db->npivots; p++) {
+        is_pivot[pivots[p]] = 1;
+    }
+    return is_pivot;
+}
+
+/*
+ * 探索に用いるスレッド数 (環境変数KOCR_THREADSで指定できる)
+ */
+static int
+nn_cpus()
+{
+    const char* env = getenv("KOCR_THREADS");
+    long        ncpus;
+
+    if (env != NULL && atoi(env) > 0) {
+        ncpus = atoi(env);
+    } else {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return (int)MAX(1, MIN(ncpus, NN_MAX_THREADS));
+}
+
+static int
+nn_threads(feature_db* db)
+{
+    if (db->nitems < NN_PARALLEL_ITEMS) {
+        return 1;
+    }
+    return nn_cpus();
+}
+
+/*
+ * 探索の準備
+ *
+ * ピボットと各クラスの重心への距離を求める。ピボット自身が最近傍の初期
+ * 候補となる。認識対象のクラスを重心による下界の小さい順にccandへ並べ、
+ * その数を返す。
+ */
+static int
+nn_prepare(feature_db* db, nn_query* q, nn_candidate* ccand)
+{
+    DIRP(*feature_data)
+    [N][N];
+    DIRP(*centroid_data)
+    [N][N];
+    class_info* cinfo;
+    char*       class_data;
+    int*        order;
+    int*        pivots;
+    int         c, n, p, nccand;
+    double      dist;
+    dist_func   dist_f = db_dist(db);
+
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    centroid_data = (DIRP(*)[N][N])((char*)db + db->centroid_offset);
+    class_data = (char*)db + db->class_offset;
+    cinfo = (class_info*)((char*)db + db->cinfo_offset);
+    order = (int*)((char*)db + db->order_offset);
+    pivots = (int*)((char*)db + db->pivot_offset);
+
+    // ピボットまでの距離
+    for (p = 0; p < db->npivots; p++) {
+        n = pivots[p];
+        q->pdist[p] = dist_f(&feature_data[n], q->target);
+        q->n_evals++;
+        if (n != q->skip && in_charset(q->charset, class_data[n])) {
+            nn_update(q, order, n, q->pdist[p]);
+        }
+    }
+
+    // 重心までの距離によるクラスごとの下界 (認識対象外のクラスは除く)
+    nccand = 0;
+    for (c = 0; c < db->nclasses; c++) {
+        if (!in_charset(q->charset, cinfo[c].label)) {
+            continue;
+        }
+        dist = dist_f(&centroid_data[c], q->target);
+        q->n_evals++;
+        ccand[nccand].bound = MAX(0, dist - cinfo[c].radius - DIST_EPS);
+        ccand[nccand].n = c;
+        nccand++;
+    }
+    qsort(ccand, nccand, sizeof(nn_candidate), compare_candidate);
+
+    return nccand;
+}
+
+/*
+ * 分枝限定・粗密カスケード探索
+ *
+ * 重心に近いクラスから順に探索し、d(q, 重心) - 半径が暫定の最小距離を
+ * 超えるクラスはまとめて除外する。いずれも厳密な下界なので、結果は
+ * 全探索と一致する。
+ *
+ * データベースが大きいときは、各クラスのエントリをスレッド数で等分して
+ * 並列に探索し、最後に各スレッドの最近傍をまとめる。同距離ならエントリ
+ * の順番で決めるので、結果はスレッド数やスケジューリングに依存しない。
+ */
+static void
+nn_search(feature_db* db, nn_query* q)
+{
+    int*           order;
+    nn_candidate*  ccand;
+    nn_worker*     workers;
+    pthread_t*     threads;
+    unsigned char* is_pivot;
+    int            t, nccand, nthreads;
+
+    order = (int*)((char*)db + db->order_offset);
+
+    ccand = (nn_candidate*)malloc(sizeof(nn_candidate) * db->nclasses);
+    is_pivot = nn_pivot_flags(db);
+    if (ccand == NULL || is_pivot == NULL) {
+        free(ccand);
+        free(is_pivot);
+        return;
+    }
+    nccand = nn_prepare(db, q, ccand);
+
+    nthreads = nn_threads(db);
+    if (nthreads <= 1) {
+        nn_scan(db, q, ccand, nccand, is_pivot, 0, 1);
+        free(is_pivot);
+        free(ccand);
+        return;
+    }
+
+    workers = (nn_worker*)malloc(sizeof(nn_worker) * nthreads);
+    threads = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
+    for (t = 0; t < nthreads; t++) {
+        workers[t].db = db;
+        workers[t].q = *q;
+        workers[t].q.n_evals = 0;
+        workers[t].ccand = ccand;
+        workers[t].nccand = nccand;
+        workers[t].is_pivot = is_pivot;
+        workers[t].part = t;
+        workers[t].nparts = nthreads;
+    }
+    for (t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, nn_worker_main, &workers[t])) {
+            // スレッドを作れなければ、後でこのスレッドで探索する
+            workers[t].db = NULL;
+        }
+    }
+    nn_worker_main(&workers[0]);
+
+    for (t = 0; t < nthreads; t++) {
+        if (t > 0) {
+            if (workers[t].db) {
+                pthread_join(threads[t], NULL);
+            } else {
+                workers[t].db = db;
+                nn_worker_main(&workers[t]);
+            }
+        }
+        nn_merge(q, order, &workers[t].q);
+    }
+
+    free(threads);
+    free(workers);
+    free(is_pivot);
+    free(ccand);
+}
+
+/*
+ * 一括探索のワーカ
+ */
+typedef struct {
+    feature_db*          db;
+    nn_query*            qs; // 問い合わせ (複数のワーカがあればその複製)
+    int                  nq;
+    nn_candidate*        ccand;  // いずれかの問い合わせの重心に近い順のクラス
+    double*              cbound; // 問い合わせごとのクラスの下界 (-1なら不要)
+    int*                 first;  // 問い合わせごとに最初に探索するクラス
+    const unsigned char* is_pivot;
+    int                  part;
+    int                  nparts;
+} nn_batch_worker;
+
+static void*
+nn_batch_main(void* arg)
+{
+    nn_batch_worker* w = (nn_batch_worker*)arg;
+    feature_db*      db = w->db;
+    DIRP(*feature_data)
+    [N][N];
+    DIRP_S*       summary_data;
+    class_info*   cinfo;
+    int*          order;
+    double*       pdist;
+    nn_candidate  one, *cand;
+    int           c, j, k, m, n, p, lo, hi, t, t_end, ncand;
+    double        dist, bound;
+    dist_func     dist_f = db_dist(db);
+
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    summary_data = (DIRP_S*)((char*)db + db->summary_offset);
+    cinfo = (class_info*)((char*)db + db->cinfo_offset);
+    order = (int*)((char*)db + db->order_offset);
+    pdist = (double*)((char*)db + db->pdist_offset);
+
+    // 各問い合わせで重心に最も近いクラスを探索し、暫定の最小距離を求める
+    for (k = 0; k < w->nq; k++) {
+        if (w->first[k] >= 0) {
+            one.n = w->first[k];
+            one.bound = 0;
+            nn_scan(db, &w->qs[k], &one, 1, w->is_pivot, w->part, w->nparts);
+        }
+    }
+
+    cand = (nn_candidate*)malloc(sizeof(nn_candidate) * NN_TILE);
+    for (j = 0; j < db->nclasses; j++) {
+        c = w->ccand[j].n;
+        if (w->ccand[j].bound < 0) {
+            // どの問い合わせでも探索不要
+            continue;
+        }
+
+        lo = cinfo[c].start + (long)cinfo[c].count * w->part / w->nparts;
+        hi = cinfo[c].start + (long)cinfo[c].count * (w->part + 1) / w->nparts;
+        for (t = lo; t < hi; t = t_end) {
+            t_end = MIN(t + NN_TILE, hi);
+
+            // タイルの特徴がキャッシュにある間に全ての問い合わせを処理する
+            for (k = 0; k < w->nq; k++) {
+                nn_query* q = &w->qs[k];
+
+                bound = w->cbound[k * db->nclasses + c];
+                if (bound < 0 || bound > q->limit) {
+                    continue;
+                }
+                ncand = 0;
+                for (n = t; n < t_end; n++) {
+                    if (n == q->skip || w->is_pivot[n]) {
+                        // ピボットは計算済み
+                        continue;
+                    }
+                    bound = w->cbound[k * db->nclasses + c];
+                    for (p = 0; p < db->npivots; p++) {
+                        dist = ABS(q->pdist[p] - pdist[n * db->npivots + p]);
+                        bound = MAX(bound, dist - DIST_EPS);
+                    }
+                    if (bound <= q->limit) {
+                        bound = MAX(bound,
+                                    DIRP_Bound(&q->summary, &summary_data[n]));
+                    }
+                    if (bound > q->limit) {
+                        continue;
+                    }
+                    cand[ncand].bound = bound;
+                    cand[ncand].n = n;
+                    ncand++;
+                }
+                qsort(cand, ncand, sizeof(nn_candidate), compare_candidate);
+
+                for (m = 0; m < ncand; m++) {
+                    if (cand[m].bound > q->limit) {
+                        break;
+                    }
+                    n = cand[m].n;
+                    dist = dist_f(&feature_data[n], q->target);
+                    q->n_evals++;
+                    nn_update(q, order, n, dist);
+                }
+            }
+        }
+    }
+    free(cand);
+
+    return NULL;
+}
+
+/*
+ * 複数の文字の一括探索
+ *
+ * 各問い合わせについて、まず重心に最も近いクラスを探索して暫定の最小
+ * 距離を求める。残りのクラスは、いずれかの問い合わせの重心に近い順に
+ * NN_TILE個ずつのタイルに分け、タイルごとに全ての問い合わせの下界と
+ * DIRP_Distを計算する。データベースの特徴量は、文字数によらずタイル
+ * 単位で1回ずつ読み込まれる。データベースが大きいときは、nn_searchと
+ * 同じく各クラスのエントリをスレッド数で等分して並列に探索する。
+ * 結果はnn_searchと一致する。
+ */
+static void
+nn_search_batch(feature_db* db, nn_query* qs, int nq)
+{
+    nn_candidate*    ccand;
+    nn_batch_worker* workers;
+    pthread_t*       threads;
+    unsigned char*   is_pivot;
+    double*          cbound;
+    int*             first;
+    int*             order;
+    int              c, k, t, nccand, nthreads;
+    double           bound;
+
+    if (nq <= 0) {
+        return;
+    }
+    order = (int*)((char*)db + db->order_offset);
+
+    ccand = (nn_candidate*)malloc(sizeof(nn_candidate) * db->nclasses);
+    cbound = (double*)malloc(sizeof(double) * nq * db->nclasses);
+    first = (int*)malloc(sizeof(int) * nq);
+    is_pivot = nn_pivot_flags(db);
+    if (ccand == NULL || cbound == NULL || first == NULL || is_pivot == NULL) {
+        free(ccand);
+        free(cbound);
+        free(first);
+        free(is_pivot);
+        return;
+    }
+
+    for (k = 0; k < nq; k++) {
+        for (c = 0; c < db->nclasses; c++) {
+            cbound[k * db->nclasses + c] = -1;
+        }
+        nccand = nn_prepare(db, &qs[k], ccand);
+        for (c = 0; c < nccand; c++) {
+            cbound[k * db->nclasses + ccand[c].n] = ccand[c].bound;
+        }
+        first[k] = -1;
+        if (nccand > 0) {
+            first[k] = ccand[0].n;
+            cbound[k * db->nclasses + ccand[0].n] = -1;
+        }
+    }
+
+    // いずれかの問い合わせの重心に近いクラスから順に処理する
+    for (c = 0; c < db->nclasses; c++) {
+        ccand[c].bound = -1;
+        ccand[c].n = c;
+        for (k = 0; k < nq; k++) {
+            bound = cbound[k * db->nclasses + c];
+            if (bound >= 0 && (ccand[c].bound < 0 || bound < ccand[c].bound)) {
+                ccand[c].bound = bound;
+            }
+        }
+    }
+    qsort(ccand, db->nclasses, sizeof(nn_candidate), compare_candidate);
+
+    nthreads = nn_threads(db);
+    workers = (nn_batch_worker*)malloc(sizeof(nn_batch_worker) * nthreads);
+    threads = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
+    for (t = 0; t < nthreads; t++) {
+        workers[t].db = db;
+        workers[t].qs = qs;
+        workers[t].nq = nq;
+        workers[t].ccand = ccand;
+        workers[t].cbound = cbound;
+        workers[t].first = first;
+        workers[t].is_pivot = is_pivot;
+        workers[t].part = t;
+        workers[t].nparts = nthreads;
+        if (nthreads > 1) {
+            // 暫定の近傍はワーカごとに持つ
+            workers[t].qs = (nn_query*)malloc(sizeof(nn_query) * nq);
+            for (k = 0; k < nq; k++) {
+                workers[t].qs[k] = qs[k];
+                workers[t].qs[k].n_evals = 0;
+            }
+        }
+    }
+    for (t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, nn_batch_main, &workers[t])) {
+            // スレッドを作れなければ、後でこのスレッドで探索する
+            workers[t].db = NULL;
+        }
+    }
+    nn_batch_main(&workers[0]);
+
+    for (t = 1; t < nthreads; t++) {
+        if (workers[t].db) {
+            pthread_join(threads[t], NULL);
+        } else {
+            workers[t].db = db;
+            nn_batch_main(&workers[t]);
+        }
+    }
+    if (nthreads > 1) {
+        for (t = 0; t < nthreads; t++) {
+            for (k = 0; k < nq; k++) {
+                nn_merge(&qs[k], order, &workers[t].qs[k]);
+            }
+            free(workers[t].qs);
+        }
+    }
+
+    free(threads);
+    free(workers);
+    free(is_pivot);
+    free(first);
+    free(cbound);
+    free(ccand);
+}
+
+/*
+ * 全探索 (カスケード探索の検証用)
+ */
+static void
+nn_search_exhaustive(feature_db* db, nn_query* q)
+{
+    DIRP(*feature_data)
+    [N][N];
+    char*     class_data;
+    int*      order;
+    int       n;
+    double    dist;
+    dist_func dist_f = db_dist(db);
+
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    class_data = (char*)db + db->class_offset;
+    order = (int*)((char*)db + db->order_offset);
+
+    for (n = 0; n < db->nitems; n++) {
+        if (n == q->skip || !in_charset(q->charset, class_data[n])) {
+            continue;
+        }
+        dist = dist_f(&feature_data[n], q->target);
+        q->n_evals++;
+        nn_update(q, order, n, dist);
+    }
+}
+
+#ifndef LIBRARY
+/*
+ * 信頼度 (1 - 最小距離 / 探索対象の全エントリへの距離の平均)
+ *
+ * 枝刈りした探索では一部のエントリまでの距離しか求まらないので、
+ * 表示する時だけ全エントリへの距離を求め直す。
+ */
+static double
+nn_credibility(feature_db* db, nn_query* q, double min_dist)
+{
+    DIRP(*feature_data)
+    [N][N];
+    char*     class_data;
+    int       n, count;
+    double    total;
+    dist_func dist_f = db_dist(db);
+
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    class_data = (char*)db + db->class_offset;
+
+    total = 0;
+    count = 0;
+    for (n = 0; n < db->nitems; n++) {
+        if (n == q->skip || !in_charset(q->charset, class_data[n])) {
+            continue;
+        }
+        total += dist_f(&feature_data[n], q->target);
+        count++;
+    }
+    return 1 - count * min_dist / total;
+}
+#endif
+
+/*
+ * 全エントリ間の最近傍 (leave-one-out用)
+ *
+ * 方向特徴をエントリごとに連続したバイト列に詰め直し、NN_TILE四方の
+ * タイルごとに距離の2乗を整数で求める。距離は対称なので各組は1度だけ
+ * 計算し、両方のエントリの最近傍を更新する。タイルの行をスレッドに
+ * 順に割り当て、スレッドごとの結果を最後にまとめる。
+ * 同距離の場合は画像リスト上の順番が早い方を採る (nn_searchと同じ)。
+ * tilesがNULLでなければ、量子化した距離をタイルごとに格納する。
+ * nearestがNULLなら最近傍は返さない。
+ */
+typedef struct {
+    unsigned char*  packed; // エントリごとの方向特徴
+    int             len;    // 1エントリあたりのバイト数
+    int             nitems;
+    int*            order;
+    int             ntiles;
+    int             next; // 次に割り当てるタイルの行
+    pthread_mutex_t lock;
+    unsigned short* tiles; // 量子化した距離 (NULLなら格納しない)
+    double          step;  // 量子化の幅
+} nn_pairs;
+
+typedef struct {
+    nn_pairs* pairs;
+    int*      nearest; // 最近傍のエントリ
+    int*      near_d;  // 最近傍までの距離の2乗
+} nn_pairs_worker;
+
+static int
+nn_dist2(const unsigned char* a, const unsigned char* b, int len)
+{
+    int i, diff, sum = 0;
+
+    for (i = 0; i < len; i++) {
+        diff = (int)a[i] - (int)b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+static void
+nn_pairs_update(int* order, int* nearest, int* near_d, int n, int m, int d)
+{
+    if (nearest[n] < 0 || d < near_d[n]
+        || (d == near_d[n] && order[m] < order[nearest[n]])) {
+        nearest[n] = m;
+        near_d[n] = d;
+    }
+}
+
+/*
+ * タイルi, j (i <= j) の先頭
+ */
+static long
+nn_tile_offset(int ntiles, int ti, int tj)
+{
+    return ((long)ti * ntiles - (long)ti * (ti - 1) / 2 + tj - ti) * NN_TILE
+           * NN_TILE;
+}
+
+static void*
+nn_pairs_main(void* arg)
+{
+    nn_pairs_worker* w = (nn_pairs_worker*)arg;
+    nn_pairs*        p = w->pairs;
+    unsigned short*  tile;
+    int              ti, tj, i, j, i_end, j_end, d, q;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        ti = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        if (ti >= p->ntiles) {
+            break;
+        }
+
+        i_end = MIN((ti + 1) * NN_TILE, p->nitems);
+        for (tj = ti; tj < p->ntiles; tj++) {
+            j_end = MIN((tj + 1) * NN_TILE, p->nitems);
+            tile = p->tiles ? &p->tiles[nn_tile_offset(p->ntiles, ti, tj)]
+                            : NULL;
+            for (i = ti * NN_TILE; i < i_end; i++) {
+                const unsigned char* a = &p->packed[(long)i * p->len];
+
+                for (j = tj == ti ? i + 1 : tj * NN_TILE; j < j_end; j++) {
+                    d = nn_dist2(a, &p->packed[(long)j * p->len], p->len);
+                    nn_pairs_update(p->order, w->nearest, w->near_d, i, j, d);
+                    nn_pairs_update(p->order, w->nearest, w->near_d, j, i, d);
+                    if (tile) {
+                        q = (int)MIN(sqrt((double)d) / p->step, DIST_CACHE_MAX);
+                        tile[(i % NN_TILE) * NN_TILE + j % NN_TILE] = q;
+                        if (ti == tj) {
+                            tile[(j % NN_TILE) * NN_TILE + i % NN_TILE] = q;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static void
+nn_all_pairs(feature_db*     db,
+             int*            nearest,
+             double*         near_d,
+             unsigned short* tiles,
+             double          step)
+{
+    DIRP(*feature_data)
+    [N][N];
+    nn_pairs         p;
+    nn_pairs_worker* w;
+    pthread_t*       threads;
+    int              i, j, d, n, t, nthreads;
+
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+
+    p.len = N * N * db->channels;
+    p.nitems = db->nitems;
+    p.order = (int*)((char*)db + db->order_offset);
+    p.ntiles = (db->nitems + NN_TILE - 1) / NN_TILE;
+    p.next = 0;
+    p.tiles = tiles;
+    p.step = step;
+    pthread_mutex_init(&p.lock, NULL);
+    p.packed = (unsigned char*)malloc((long)p.len * db->nitems);
+    for (n = 0; n < db->nitems; n++) {
+        unsigned char* a = &p.packed[(long)n * p.len];
+
+        for (i = 0; i < N; i++) {
+            for (j = 0; j < N; j++) {
+                for (d = 0; d < db->channels; d++) {
+                    *a++ = feature_data[n][i][j].d[d];
+                }
+            }
+        }
+    }
+
+    nthreads = MIN(nn_cpus(), MAX(1, p.ntiles));
+    w = (nn_pairs_worker*)malloc(sizeof(nn_pairs_worker) * nthreads);
+    threads = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
+    for (t = 0; t < nthreads; t++) {
+        w[t].pairs = &p;
+        w[t].nearest = (int*)malloc(sizeof(int) * db->nitems);
+        w[t].near_d = (int*)malloc(sizeof(int) * db->nitems);
+        for (n = 0; n < db->nitems; n++) {
+            w[t].nearest[n] = -1;
+        }
+    }
+    for (t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, nn_pairs_main, &w[t]) != 0) {
+            break;
+        }
+    }
+    nn_pairs_main(&w[0]);
+    while (--t > 0) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // スレッドごとの結果をまとめる
+    for (t = 1; t < nthreads; t++) {
+        for (n = 0; n < db->nitems; n++) {
+            if (w[t].nearest[n] >= 0) {
+                nn_pairs_update(p.order,
+                                w[0].nearest,
+                                w[0].near_d,
+                                n,
+                                w[t].nearest[n],
+                                w[t].near_d[n]);
+            }
+        }
+    }
+    for (n = 0; nearest && n < db->nitems; n++) {
+        nearest[n] = w[0].nearest[n];
+        near_d[n] = nearest[n] < 0 ? 1e10 : sqrt((double)w[0].near_d[n]);
+    }
+
+    for (t = 0; t < nthreads; t++) {
+        free(w[t].nearest);
+        free(w[t].near_d);
+    }
+    free(w);
+    free(threads);
+    free(p.packed);
+    pthread_mutex_destroy(&p.lock);
+}
+
+/*
+ * 全エントリ間の距離のキャッシュ
+ *
+ * 距離を幅stepで量子化し (DIST_CACHE_MAX以下の整数)、nn_all_pairsの
+ * タイルの順に並べて保持する。大きさがDIST_CACHE_LIMITを超える場合は
+ * 作らない (NULLを返す)。
+ * 環境変数KOCR_CACHE_DIRかKOCR_CACHEが設定されていればファイルに保存し、
+ * 2回目以降はmmapして共有する。場所はKOCR_CACHE_DIR、無ければ
+ * $XDG_CACHE_HOME/kocrか~/.cache/kocr (0700で作る) で、ファイル名と
+ * ヘッダに特徴量のハッシュを含めるので、データベースが変わると別の
+ * キャッシュになる。他のユーザが置いたファイルは使わない。
+ * 量子化した距離は候補の絞り込みにのみ用い、最近傍は正確な距離で決める。
+ */
+static int
+dist_cache_valid(dist_cache_header* h, feature_db* db, unsigned int hash)
+{
+    return h->magic == DIST_CACHE_MAGIC && h->hash == hash
+           && h->nitems == db->nitems && h->channels == db->channels
+           && h->tile == NN_TILE && h->complete;
+}
+
+/*
+ * 自分だけが書き込めるディレクトリか (無ければ0700で作る)
+ */
+static int
+dist_cache_mkdir(const char* dir)
+{
+    struct stat sb;
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return FALSE;
+    }
+    return lstat(dir, &sb) == 0 && S_ISDIR(sb.st_mode)
+           && sb.st_uid == getuid() && !(sb.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/*
+ * キャッシュを保存するディレクトリ (保存しなければFALSEを返す)
+ */
+static int
+dist_cache_dir(char* dir, size_t size)
+{
+    const char* env;
+    char        base[MAXSTRLEN];
+
+    if ((env = getenv("KOCR_CACHE_DIR")) != NULL && *env) {
+        snprintf(dir, size, "%s", env);
+        return TRUE;
+    }
+    if ((env = getenv("KOCR_CACHE")) == NULL || !*env || !strcmp(env, "0")) {
+        return FALSE;
+    }
+
+    if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env) {
+        snprintf(base, sizeof(base), "%s", env);
+    } else if ((env = getenv("HOME")) != NULL && *env) {
+        snprintf(base, sizeof(base), "%s/.cache", env);
+        mkdir(base, 0700);
+    } else {
+        return FALSE;
+    }
+    if (snprintf(dir, size, "%s/kocr", base) >= (int)size) {
+        return FALSE;
+    }
+    return dist_cache_mkdir(dir);
+}
+
+static dist_cache*
+dist_cache_open(feature_db* db)
+{
+    dist_cache*        c;
+    dist_cache_header* h;
+    unsigned int       hash = db_hash(db);
+    char               dir[MAXSTRLEN];
+    char               path[MAXSTRLEN], tmp_path[MAXSTRLEN];
+    int                fd, save;
+    struct stat        sb;
+
+    c = (dist_cache*)malloc(sizeof(dist_cache));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->ntiles = (db->nitems + NN_TILE - 1) / NN_TILE;
+    c->length = sizeof(dist_cache_header)
+                + sizeof(unsigned short)
+                      * nn_tile_offset(c->ntiles, c->ntiles, c->ntiles);
+    if (c->length > DIST_CACHE_LIMIT) {
+        free(c);
+        return NULL;
+    }
+
+    // パスが長すぎる場合は保存しない
+    save = dist_cache_dir(dir, sizeof(dir))
+           && snprintf(path,
+                       sizeof(path),
+                       "%s/kocr-%08x-%d.dist",
+                       dir,
+                       hash,
+                       db->nitems)
+                  < (int)sizeof(path)
+           && snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path)
+                  < (int)sizeof(tmp_path);
+
+    // 保存済みのキャッシュ (自分が作った通常のファイルに限る)
+    if (save && (fd = open(path, O_RDONLY | O_NOFOLLOW)) >= 0) {
+        h = (dist_cache_header*)MAP_FAILED;
+        if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)
+            && sb.st_uid == getuid() && !(sb.st_mode & (S_IWGRP | S_IWOTH))
+            && (size_t)sb.st_size == c->length) {
+            h = (dist_cache_header*)mmap(
+                NULL, c->length, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (h != MAP_FAILED && dist_cache_valid(h, db, hash)) {
+            c->header = h;
+            c->tiles = (unsigned short*)(h + 1);
+            c->mapped = TRUE;
+            return c;
+        }
+        if (h != MAP_FAILED) {
+            munmap(h, c->length);
+        }
+    }
+
+    // 新たに作る (mkstempで作った一時ファイルに書いてから置き換える)
+    h = (dist_cache_header*)MAP_FAILED;
+    if (save) {
+        fprintf(stderr, "# Building distance cache: %s\n", path);
+        if ((fd = mkstemp(tmp_path)) >= 0) {
+            if (ftruncate(fd, c->length) == 0) {
+                h = (dist_cache_header*)mmap(
+                    NULL, c->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (h == MAP_FAILED) {
+                unlink(tmp_path);
+            }
+        }
+    }
+    c->mapped = h != MAP_FAILED;
+    if (!c->mapped) {
+        h = (dist_cache_header*)malloc(c->length);
+        if (h == NULL) {
+            free(c);
+            return NULL;
+        }
+    }
+
+    h->magic = DIST_CACHE_MAGIC;
+    h->hash = hash;
+    h->nitems = db->nitems;
+    h->channels = db->channels;
+    h->tile = NN_TILE;
+    h->step = 255 * sqrt((double)N * N * db->channels) / DIST_CACHE_MAX;
+    h->complete = FALSE;
+    c->header = h;
+    c->tiles = (unsigned short*)(h + 1);
+    nn_all_pairs(db, NULL, NULL, c->tiles, h->step);
+    h->complete = TRUE;
+
+    if (c->mapped) {
+        msync(h, c->length, MS_SYNC);
+        if (rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+        }
+    }
+
+    return c;
+}
+
+static void
+dist_cache_close(dist_cache* c)
+{
+    if (c == NULL) {
+        return;
+    }
+    if (c->mapped) {
+        munmap(c->header, c->length);
+    } else {
+        free(c->header);
+    }
+    free(c);
+}
+
+static int
+dist_cache_get(dist_cache* c, int i, int j)
+{
+    int t;
+
+    if (i / NN_TILE > j / NN_TILE) {
+        t = i;
+        i = j;
+        j = t;
+    }
+    return c->tiles[nn_tile_offset(c->ntiles, i / NN_TILE, j / NN_TILE)
+                    + (i % NN_TILE) * NN_TILE + j % NN_TILE];
+}
+
+/*
+ * キャッシュを用いたエントリnの最近傍
+ *
+ * skip[m]が真のエントリと、クラスがskip_classのエントリは除く
+ * (skipがNULL、skip_classが-1なら除かない)。量子化した距離が最小値に
+ * 近いものだけ正確な距離を求める (cがNULLなら全て求める)。最近傍が
+ * 無ければ-1を返す。
+ */
+static int
+dist_cache_nearest(dist_cache* c,
+                   feature_db* db,
+                   int         n,
+                   int*        skip,
+                   int         skip_class,
+                   double*     dist)
+{
+    DIRP(*feature_data)
+    [N][N];
+    char*     class_data;
+    int*      order;
+    int       m, q, min_q, best;
+    double    d;
+    dist_func dist_f = db_dist(db);
+
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    class_data = (char*)db + db->class_offset;
+    order = (int*)((char*)db + db->order_offset);
+
+    min_q = DIST_CACHE_MAX + 1;
+    for (m = 0; c && m < db->nitems; m++) {
+        if (m == n || (skip && skip[m]) || class_data[m] == skip_class) {
+            continue;
+        }
+        min_q = MIN(min_q, dist_cache_get(c, n, m));
+    }
+
+    // 量子化の誤差 (幅1) と丸めの誤差を見込んで候補とする
+    best = -1;
+    *dist = 1e10;
+    for (m = 0; m < db->nitems; m++) {
+        if (m == n || (skip && skip[m]) || class_data[m] == skip_class) {
+            continue;
+        }
+        if (c && (q = dist_cache_get(c, n, m)) > min_q + 2) {
+            continue;
+        }
+        d = dist_f(&feature_data[n], &feature_data[m]);
+        if (best < 0 || nn_farther(order, best, *dist, m, d)) {
+            best = m;
+            *dist = d;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * 全エントリの最近傍 (キャッシュが無ければnn_all_pairsで求める)
+ */
+static void
+dist_cache_all_nearest(dist_cache* c,
+                       feature_db* db,
+                       int*        nearest,
+                       double*     near_d)
+{
+    int n;
+
+    if (c == NULL) {
+        nn_all_pairs(db, nearest, near_d, NULL, 0);
+        return;
+    }
+    for (n = 0; n < db->nitems; n++) {
+        nearest[n] = dist_cache_nearest(c, db, n, NULL, -1, &near_d[n]);
+    }
+}
+
+/* ============================================================
+ * 文字認識用ドライバ
+ * ============================================================ */
+char*
+#ifdef USE_SVM
+recognize(CvSVM* db, IplImage* src_img, const char* charset, int k)
+#else
+recognize(feature_db* db, IplImage* src_img, const char* charset, int k)
+#endif
+{
+    double min_dist;
+    int    min_char_data;
+    int    i, j, d;
+    char   result[2];
+
+    char*    class_data;
+    DIRP     target_data[Y_SIZE][X_SIZE];
+    nn_query q;
+
+#ifdef THINNING
+    int features[N][N][ANGLES];
+
+    if (Extract_Feature_deskew(
+            cv::cvarrToMat(src_img, true), features, DB_DESKEW(db))) {
+        return 0;
+    }
+
+#ifdef USE_SVM
+    CvMat* feature_mat = cvCreateMat(1, N * N * ANGLES, CV_32FC1);
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < N; j++) {
+            for (int k = 0; k < ANGLES; k++) {
+                cvmSet(feature_mat,
+                       0,
+                       i * N * ANGLES + j * ANGLES + k,
+                       features[j][i][k]);
+            }
+        }
+    }
+#endif
+    // 最近傍法ではtrainingと同じく全ての方向特徴を用いる
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < N; j++) {
+            for (d = 0; d < CHANNELS; d++) {
+                target_data[i][j].d[d] = features[i][j][d];
+            }
+            target_data[i][j].I = 0;
+        }
+    }
+
+#else
+    datafolder*  df;
+    feature_ctx* ctx;
+
+    //
+    // 特徴抽出 (作業領域はスレッドごとに持つ)
+    //
+    if ((ctx = feature_ctx_thread()) == NULL) {
+        // 作業領域を確保できない
+        return 0;
+    }
+    extract_feature_r(ctx, src_img, &df);
+    if (df->status) {
+        // 特徴抽出失敗で真
+        return 0;
+    }
+
+    for (i = 0; i < Y_SIZE; i++) {
+        for (j = 0; j < X_SIZE; j++) {
+            for (d = 0; d < 4; d++) {
+                target_data[i][j].d[d] = df->Data[i][j].d[d];
+            }
+            target_data[i][j].I = df->Data[i][j].I;
+        }
+    }
+#endif
+
+#ifdef USE_SVM
+    // SVMでは認識対象の文字 (charset) の指定は無視する
+
+#ifdef THINNING
+    char response = (char)db->predict(feature_mat);
+    cvReleaseMat(&feature_mat);
+#else
+    /* data packing and recognization */
+    int  kk;
     char response;
 
     CvMat* Inputdata = cvCreateMat(1, Y_SIZE * X_SIZE * 4, CV_32FC1);
@@ -750,6 +2251,7 @@ recognize(feature_db* db, IplImage* src_img)
         }
     }
     response = (char)db->predict(Inputdata);
+    cvReleaseMat(&Inputdata);
 #endif
 
 #ifndef LIBRARY
@@ -767,28 +2269,23 @@ recognize(feature_db* db, IplImage* src_img)
     if (db->magic != MAGIC_NO) {
         return 0;
     }
-    nitems = db->nitems;
-    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
     class_data = (char*)db + db->class_offset;
-    min_char_data = -1;
-    min_dist = 1e10;
 
     //最短距離法
     //
-    // 類似画像検索ループ
+    // 類似画像検索
     //
-    for (n = 0; n < db->nitems; n++) {
-        dist = DIRP_Dist(&feature_data[n], &target_data);
-        total += dist;
-        if (dist < min_dist) {
-            min_dist = dist;
-            min_char_data = n;
-        }
+    nn_query_init(&q, &target_data, -1, charset, nn_k(db, k));
+    nn_search(db, &q);
+    min_char_data = nn_vote(db, &q, &min_dist);
+    if (min_char_data < 0) {
+        // 認識対象の文字がデータベースに無い
+        return 0;
     }
 
 #ifndef LIBRARY
     printf("Recogized: %c (%f)\n", class_data[min_char_data], min_dist);
-    printf("Credibility score %2.2f\n", 1 - n * min_dist / total);
+    printf("Credibility score %2.2f\n", nn_credibility(db, &q, min_dist));
 #endif
 
     result[0] = class_data[min_char_data];
@@ -800,35 +2297,52 @@ recognize(feature_db* db, IplImage* src_img)
 
 char*
 #ifdef USE_SVM
-recognize_multi(CvSVM* db, IplImage* src_img)
+recognize_multi(CvSVM* db, IplImage* src_img, const char* charset, int k)
 #else
-recognize_multi(feature_db* db, IplImage* src_img)
+recognize_multi(feature_db* db,
+                IplImage*   src_img,
+                const char* charset,
+                int         k)
 #endif
 {
-    double    min_dist, dist;
+    double    min_dist;
     int       min_char_data;
-    int       n, nitems;
+    int       n;
     int       i, j, d;
-    IplImage* dst_img = NULL;
     CvRect    bb;
     IplImage *part_img, *body;
     int       seq_num, start_x, width, next_start;
-    char      result_char, filename[BUFSIZ], *result_str;
+    char      result_char, *result_str;
 
-    DIRP(*feature_data)
+    char* class_data;
+    DIRP  target_data[Y_SIZE][X_SIZE];
+#ifndef THINNING
+    int          ret;
+    datafolder*  df;
+    feature_ctx* ctx;
+#endif
+    // 切り出した文字の特徴とその確保済みの要素数
+    DIRP(*targets)
     [Y_SIZE][X_SIZE];
-    char*       class_data;
-    DIRP        target_data[Y_SIZE][X_SIZE];
-    datafolder* df;
-
-    double total = 0;
+    int       ntargets;
+    nn_query* qs;
 
     if (src_img == NULL) {
         return NULL;
     }
+#ifndef USE_SVM
+    //
+    // データベース利用前処理
+    //
+    if (db->magic != MAGIC_NO) {
+        return NULL;
+    }
+    class_data = (char*)db + db->class_offset;
+    ntargets = 0;
+    targets = NULL;
+#endif
 
     // 白黒に変換する(0,255の二値)
-    dst_img = cvCreateImage(cvSize(src_img->width, src_img->height), 8, 1);
     cvThreshold(src_img, src_img, 120, 255, CV_THRESH_BINARY);
 
     // 文字列全体のBB
@@ -858,6 +2372,9 @@ recognize_multi(feature_db* db, IplImage* src_img)
     while (start_x < width) {
         part_img = cropnum(body, start_x, &next_start);
         if (part_img == NULL || part_img->width == 0) {
+            if (part_img != NULL) {
+                cvReleaseImage(&part_img);
+            }
             break;
         }
 
@@ -868,10 +2385,19 @@ recognize_multi(feature_db* db, IplImage* src_img)
 #ifdef THINNING
         int features[N][N][ANGLES];
 
-        if (Extract_Feature(cv::cvarrToMat(part_img, true), features)) {
+        if (Extract_Feature_deskew(
+                cv::cvarrToMat(part_img, true), features, DB_DESKEW(db))) {
+            cvReleaseImage(&part_img);
+            cvReleaseImage(&body);
+#ifndef USE_SVM
+            free(targets);
+#endif
+            free(result_str);
             return 0;
         }
+        cvReleaseImage(&part_img);
 
+#ifdef USE_SVM
         CvMat* feature_mat = cvCreateMat(1, N * N * ANGLES, CV_32FC1);
         for (i = 0; i < N; i++) {
             for (j = 0; j < N; j++) {
@@ -883,12 +2409,24 @@ recognize_multi(feature_db* db, IplImage* src_img)
                 }
             }
         }
-#else
-        if (extract_feature(part_img, &df) == -1) {
-            free(result_str);
-            return NULL;
+#endif
+        for (i = 0; i < N; i++) {
+            for (j = 0; j < N; j++) {
+                for (d = 0; d < CHANNELS; d++) {
+                    target_data[i][j].d[d] = features[i][j][d];
+                }
+                target_data[i][j].I = 0;
+            }
         }
-        if (df->status) {
+#else
+        ctx = feature_ctx_thread();
+        ret = ctx != NULL ? extract_feature_r(ctx, part_img, &df) : -1;
+        cvReleaseImage(&part_img);
+        if (ret == -1 || df->status) {
+            cvReleaseImage(&body);
+#ifndef USE_SVM
+            free(targets);
+#endif
             free(result_str);
             return NULL;
         }
@@ -906,6 +2444,7 @@ recognize_multi(feature_db* db, IplImage* src_img)
 
 #ifdef THINNING
         result_char = (char)db->predict(feature_mat);
+        cvReleaseMat(&feature_mat);
 #else
         /* data packing and recognization */
         int  kk;
@@ -923,6 +2462,7 @@ recognize_multi(feature_db* db, IplImage* src_img)
             }
         }
         result_char = (char)db->predict(Inputdata);
+        cvReleaseMat(&Inputdata);
 #endif
 
         *(result_str + seq_num) = result_char;
@@ -933,68 +2473,73 @@ recognize_multi(feature_db* db, IplImage* src_img)
 #endif
 
 #else
-        //
-        // データベース利用前処理
-        //
-        if (db->magic != MAGIC_NO) {
+        // 類似画像検索は全ての文字を切り出してからまとめて行う
+        if (seq_num >= ntargets) {
+            ntargets = ntargets ? ntargets * 2 : 16;
+            targets = (DIRP(*)[Y_SIZE][X_SIZE])realloc(
+                targets, sizeof(DIRP[Y_SIZE][X_SIZE]) * ntargets);
+        }
+        memcpy(&targets[seq_num], target_data, sizeof(target_data));
+#endif /* USE_SVM */
+
+        start_x = next_start;
+        seq_num++;
+    }
+    cvReleaseImage(&body);
+
+#ifndef USE_SVM
+    //
+    // 類似画像検索 (データベースを文字数分読み込まないよう一括で行う)
+    //
+    qs = (nn_query*)malloc(sizeof(nn_query) * (seq_num + 1));
+    for (n = 0; n < seq_num; n++) {
+        nn_query_init(&qs[n], &targets[n], -1, charset, nn_k(db, k));
+    }
+    nn_search_batch(db, qs, seq_num);
+
+    for (n = 0; n < seq_num; n++) {
+        min_char_data = nn_vote(db, &qs[n], &min_dist);
+        if (min_char_data < 0) {
+            // 認識対象の文字がデータベースに無い
+            free(qs);
+            free(targets);
             free(result_str);
             return NULL;
         }
-        nitems = db->nitems;
-        feature_data =
-            (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
-        class_data = (char*)db + db->class_offset;
-        min_char_data = -1;
-        min_dist = 1e10;
 
-        //
-        // 類似画像検索ループ
-        //
-        for (n = 0; n < db->nitems; n++) {
-            dist = DIRP_Dist(&feature_data[n], &target_data);
-            total += dist;
-            if (dist < min_dist) {
-                min_dist = dist;
-                min_char_data = n;
-            }
-        }
         // 結果はretchar
         result_char = class_data[min_char_data];
-        *(result_str + seq_num) = result_char;
-        *(result_str + seq_num + 1) = 0;
+        *(result_str + n) = result_char;
+        *(result_str + n + 1) = 0;
 
 #ifndef LIBRARY
         // 結果を出力する
         printf("Recogized: %c (%f)\n", class_data[min_char_data], min_dist);
-        printf("Credibility score %2.2f\n", 1 - n * min_dist / total);
+        printf("Credibility score %2.2f\n",
+               nn_credibility(db, &qs[n], min_dist));
 #endif
-
-#endif /* USE_SVM */
-
-        start_x = next_start;
-        seq_num++;
-
-        // XXX: extract_feature内で開放済み...?
-        // cvReleaseImage(&part_img);
     }
+    free(qs);
+    free(targets);
+#endif /* USE_SVM */
 
     return result_str;
 }
 
 #ifdef USE_SVM
 static char*
-recog_image(CvSVM* db, IplImage* src_img)
+recog_image(CvSVM* db, IplImage* src_img, const char* charset, int k)
 #else
 static char*
-recog_image(feature_db* db, IplImage* src_img)
+recog_image(feature_db* db, IplImage* src_img, const char* charset, int k)
 #endif
 {
     char* result;
 
     if (src_img->width / src_img->height > THRES_RATIO) {
-        result = recognize_multi(db, src_img);
+        result = recognize_multi(db, src_img, charset, k);
     } else {
-        result = recognize(db, src_img);
+        result = recognize(db, src_img, charset, k);
     }
 
     return result;
@@ -1062,17 +2607,16 @@ print_line(char* file, int n)
 void
 exclude(feature_db* db, char* lst_name)
 {
-    double min_dist, dist;
-    int    min_char_data;
-    int    i, j, n, m;
-    int    correct;
-    int    miss;
-    int    nitems; // 画像数
-    char   file_num[300];
-    DIRP(*feature_data)
-    [Y_SIZE][X_SIZE];
-    char* class_data;
-    int*  deleted;
+    int         n;
+    int         correct;
+    int         miss;
+    int         nitems; // 画像数
+    char*       class_data;
+    int*        deleted;
+    int *       order, *index, *nearest;
+    int         k;
+    double*     near_d;
+    dist_cache* cache;
 
     // データベースファイル識別
     if (db->magic != MAGIC_NO) {
@@ -1080,37 +2624,44 @@ exclude(feature_db* db, char* lst_name)
     }
 
     nitems = db->nitems;
-    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
     class_data = (char*)db + db->class_offset;
     deleted = (int*)calloc(nitems, sizeof(int));
 
+    // 画像リストの順に処理する
+    order = (int*)((char*)db + db->order_offset);
+    index = (int*)malloc(sizeof(int) * nitems);
+    for (n = 0; n < nitems; n++) {
+        index[order[n]] = n;
+    }
+
     fprintf(stderr, "# Excluding failure cases...\n");
     fprintf(stderr, "%s\n", lst_name);
 
+    // 全エントリの最近傍を求めておき、最近傍が除外されたエントリのみ
+    // 探索し直す (除外されていない最近傍は、候補が減っても変わらない)
+    cache = dist_cache_open(db);
+    nearest = (int*)malloc(sizeof(int) * nitems);
+    near_d = (double*)malloc(sizeof(double) * nitems);
+    dist_cache_all_nearest(cache, db, nearest, near_d);
+
     do {
         correct = miss = 0;
-        for (n = 0; n < nitems; n++) {
+        for (k = 0; k < nitems; k++) {
+            n = index[k];
             if (deleted[n]) {
                 continue;
             }
-            min_char_data = -1;
-            min_dist = 1e10;
-            // 最近傍探索
-            for (m = 0; m < nitems; m++) {
-                if (m != n && !deleted[m]) {
-                    dist = DIRP_Dist(&feature_data[n], &feature_data[m]);
-                    if (dist < min_dist) {
-                        min_dist = dist;
-                        min_char_data = m;
-                    }
-                }
+            if (nearest[n] >= 0 && deleted[nearest[n]]) {
+                // 最近傍探索
+                nearest[n] =
+                    dist_cache_nearest(cache, db, n, deleted, -1, &near_d[n]);
             }
 
-            if (class_data[n] == class_data[min_char_data]) {
+            if (nearest[n] < 0 || class_data[n] == class_data[nearest[n]]) {
                 correct++;
             } else {
                 miss++;
-                print_line(lst_name, n);
+                print_line(lst_name, order[n]);
                 deleted[n] = -1;
             }
         }
@@ -1122,21 +2673,468 @@ exclude(feature_db* db, char* lst_name)
             correct,
             nitems);
     free(deleted);
+    free(index);
+    free(nearest);
+    free(near_d);
+    dist_cache_close(cache);
+}
+
+void
+distance(feature_db* db, char* lst_name)
+{
+    double      min_dist;
+    int         min_char_data;
+    int         n;
+    int         correct;
+    int         nitems;
+    char*       class_data;
+    int *       order, *index;
+    int         k;
+    dist_cache* cache;
+
+    if (db->magic != MAGIC_NO) {
+        return;
+    }
+    nitems = db->nitems;
+    class_data = (char*)db + db->class_offset;
+
+    // 画像リストの順に処理する
+    order = (int*)((char*)db + db->order_offset);
+    index = (int*)malloc(sizeof(int) * nitems);
+    for (n = 0; n < nitems; n++) {
+        index[order[n]] = n;
+    }
+
+    fprintf(stderr, "# Measuring distance to nearest stranger...\n");
+    fprintf(stderr, "%s\n", lst_name);
+
+    correct = 0;
+    cache = dist_cache_open(db);
+    // 他のクラスの中での最近傍探索
+    for (k = 0; k < nitems; k++) {
+        n = index[k];
+        min_char_data =
+            dist_cache_nearest(cache, db, n, NULL, class_data[n], &min_dist);
+        if (min_char_data < 0) {
+            continue;
+        }
+        // 最小距離の表示
+        printf("%4.1f\t%c\t", min_dist, class_data[min_char_data]);
+        print_line(lst_name, order[n]);
+    }
+
+    fprintf(stderr,
+            "Recog-rate = %g (= %d / %d )\n",
+            (double)correct / nitems,
+            correct,
+            nitems);
+    free(index);
+    dist_cache_close(cache);
+}
+
+/*
+ * クラスの平均までの距離を並列に求めるワーカ
+ */
+typedef struct {
+    feature_db* db;
+    DIRP (*mean)[Y_SIZE][X_SIZE]; // クラスごとの特徴量の平均
+    int*    slot;                 // 各エントリが属するクラスの番号
+    double* dist;                 // 各エントリからクラスの平均までの距離
+    int     part;
+    int     nparts;
+} average_worker;
+
+static void*
+average_main(void* arg)
+{
+    average_worker* w = (average_worker*)arg;
+    DIRP(*feature_data)
+    [Y_SIZE][X_SIZE];
+    dist_func dist_f = db_dist(w->db);
+    int       n;
+
+    feature_data =
+        (DIRP(*)[Y_SIZE][X_SIZE])((char*)w->db + w->db->feature_offset);
+    for (n = w->part; n < w->db->nitems; n += w->nparts) {
+        w->dist[n] = dist_f(&w->mean[w->slot[n]], &feature_data[n]);
+    }
+    return NULL;
+}
+
+/*
+ * クラスの平均と各エントリの距離
+ *
+ * エントリはクラス順に並んでいるので、1回の走査でクラスごとの総和を
+ * 求める。平均は従来通り切り捨てた値を用いる。各クラスの統計 (db_packで
+ * 求めてデータベースに記録した分散の総和と、平均までの距離の最大値) を
+ * 標準エラー出力に出す。後者はクラスの半径の目安になる。
+ */
+void
+average(feature_db* db, char* lst_name)
+{
+    double*         sum;  //クラスごとの特徴量の総和
+    double*         dist;
+    double          max_dist, total_dist;
+    int             i, j, n, d, c, k, t;
+    int             nitems, channels, len, nthreads;
+    DIRP(*mean)[Y_SIZE][X_SIZE]; //クラスごとの特徴量の平均
+    DIRP(*feature_data)
+    [Y_SIZE][X_SIZE];
+    class_info*     cinfo;
+    int*            order;
+    int*            slot;
+    average_worker* workers;
+    pthread_t*      threads;
+
+    if (db->magic != MAGIC_NO) {
+        return;
+    }
+    nitems = db->nitems;
+    channels = db->channels;
+    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
+    cinfo = (class_info*)((char*)db + db->cinfo_offset);
+    order = (int*)((char*)db + db->order_offset);
+
+    fprintf(stderr, "# Measuring average feature...\n");
+    fprintf(stderr, "%s\n", lst_name);
+
+    len = Y_SIZE * X_SIZE * channels;
+    sum = (double*)calloc((size_t)db->nclasses * len, sizeof(double));
+    mean = (DIRP(*)[Y_SIZE][X_SIZE])calloc(db->nclasses,
+                                             sizeof(DIRP[Y_SIZE][X_SIZE]));
+    slot = (int*)malloc(sizeof(int) * nitems);
+    dist = (double*)malloc(sizeof(double) * nitems);
+
+    // 1回の走査でクラスごとの総和を求める (分散はdb_packで求めてある)
+    for (c = 0; c < db->nclasses; c++) {
+        double* s = sum + (size_t)c * len;
+
+        for (n = cinfo[c].start; n < cinfo[c].start + cinfo[c].count; n++) {
+            slot[n] = c;
+            k = 0;
+            for (i = 0; i < Y_SIZE; i++) {
+                for (j = 0; j < X_SIZE; j++) {
+                    for (d = 0; d < channels; d++, k++) {
+                        s[k] += feature_data[n][i][j].d[d];
+                    }
+                }
+            }
+        }
+
+        // クラスごとの特徴量の平均
+        k = 0;
+        for (i = 0; i < Y_SIZE; i++) {
+            for (j = 0; j < X_SIZE; j++) {
+                for (d = 0; d < channels; d++, k++) {
+                    mean[c][i][j].d[d] = (int)(s[k] / cinfo[c].count);
+                }
+            }
+        }
+    }
+
+    // 平均までの距離はエントリごとに独立なので並列に求める
+    nthreads = MIN(nn_cpus(), MAX(1, nitems));
+    workers = (average_worker*)malloc(sizeof(average_worker) * nthreads);
+    threads = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
+    for (t = 0; t < nthreads; t++) {
+        workers[t].db = db;
+        workers[t].mean = mean;
+        workers[t].slot = slot;
+        workers[t].dist = dist;
+        workers[t].part = t;
+        workers[t].nparts = nthreads;
+    }
+    for (t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, average_main, &workers[t])) {
+            // スレッドを作れなければ、後でこのスレッドで求める
+            workers[t].db = NULL;
+        }
+    }
+    average_main(&workers[0]);
+    for (t = 1; t < nthreads; t++) {
+        if (workers[t].db) {
+            pthread_join(threads[t], NULL);
+        } else {
+            workers[t].db = db;
+            average_main(&workers[t]);
+        }
+    }
+
+    // print dist
+    fprintf(stderr, "# class\tcount\tvariance\tmean-dist\tmax-dist\n");
+    for (c = 0; c < db->nclasses; c++) {
+        max_dist = 0;
+        total_dist = 0;
+        for (n = cinfo[c].start; n < cinfo[c].start + cinfo[c].count; n++) {
+            printf("%4.1f\t", dist[n]);
+            print_line(lst_name, order[n]);
+            total_dist += dist[n];
+            max_dist = MAX(max_dist, dist[n]);
+        }
+
+        fprintf(stderr,
+                "# %c\t%d\t%.1f\t%.1f\t%.1f\n",
+                cinfo[c].label,
+                cinfo[c].count,
+                cinfo[c].variance,
+                total_dist / cinfo[c].count,
+                max_dist);
+    }
+
+    free(workers);
+    free(threads);
+    free(dist);
+    free(slot);
+    free(mean);
+    free(sum);
+}
+
+/*
+ * 特徴抽出のメモリ使用量の検証
+ *
+ * 画像リストの画像を繰り返し、count文字 (0ならSOAK_COUNT文字) の特徴
+ * を抽出する。SOAK_REPORT文字ごとに最大常駐セットサイズを標準エラー
+ * 出力に出す。作業領域を使い回していれば、最初の周回の後は増えない。
+ * 抽出した特徴がデータベースのエントリと異なる文字の数も数える。
+ */
+void
+soak(feature_db* db, char* lst_name, int count)
+{
+    DIRP(*feature_data)
+    [Y_SIZE][X_SIZE];
+    DIRP   target_data[Y_SIZE][X_SIZE];
+    char   line_buf[300], path[400];
+    char** names;
+    char * target_dir, *p;
+    int *  order, *index;
+    int    i, j, d, n, m, g;
+    int    nlines, nnames, mismatch, failed;
+    FILE*  listfile;
+    struct rusage ru;
+#ifdef THINNING
+    int features[N][N][ANGLES];
+#else
+    feature_ctx* ctx;
+    datafolder*  df;
+#endif
+
+    if (db->magic != MAGIC_NO) {
+        return;
+    }
+    if (count <= 0) {
+        count = SOAK_COUNT;
+    }
+    if ((listfile = fopen(lst_name, "rt")) == NULL) {
+        printf("image list file is not found. aborting...\n");
+        return;
+    }
+    nlines = 0;
+    while (fgets(line_buf, sizeof(line_buf), listfile) != NULL) {
+        nlines++;
+    }
+
+    target_dir = strdup(lst_name);
+    p = strrchr(target_dir, '/');
+    if (p) {
+        *p = '\0';
+    } else {
+        free(target_dir);
+        target_dir = strdup("./");
+    }
+
+    names = (char**)calloc(nlines + 1, sizeof(char*));
+    rewind(listfile);
+    for (n = nnames = 0; n < nlines; n++) {
+        if (fgets(line_buf, sizeof(line_buf), listfile) == NULL) {
+            break;
+        }
+        if (list_entry(line_buf, target_dir, path)) {
+            names[n] = strdup(path);
+            nnames++;
+        }
+    }
+    fclose(listfile);
+    free(target_dir);
+
+    // 画像リストの行からエントリへの対応
+    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
+    order = (int*)((char*)db + db->order_offset);
+    index = (int*)malloc(sizeof(int) * (nlines + 1));
+    for (n = 0; n < nlines; n++) {
+        index[n] = -1;
+    }
+    for (m = 0; m < db->nitems; m++) {
+        if (order[m] >= 0 && order[m] < nlines) {
+            index[order[m]] = m;
+        }
+    }
+
+    fprintf(stderr, "# Extracting %d glyphs from %s...\n", count, lst_name);
+    fprintf(stderr, "# glyphs maxrss(KB) mismatch failed\n");
+
+#ifndef THINNING
+    if ((ctx = (feature_ctx*)calloc(1, sizeof(feature_ctx))) == NULL) {
+        fprintf(stderr, "cannot allocate the work area\n");
+        nnames = 0;
+    }
+#endif
+    mismatch = failed = 0;
+    for (g = n = 0; g < count && nnames > 0; n = (n + 1) % nlines) {
+        if (names[n] == NULL) {
+            continue;
+        }
+        memset(target_data, 0, sizeof(target_data));
+#ifdef THINNING
+        if (Extract_Feature_wrapper_deskew(names[n], features, db->deskew)) {
+            failed++;
+        }
+        for (i = 0; i < N; i++) {
+            for (j = 0; j < N; j++) {
+                for (d = 0; d < ANGLES; d++) {
+                    target_data[j][i].d[d] = features[j][i][d];
+                }
+            }
+        }
+#else
+        extract_feature_wrapper_r(ctx, names[n], &df);
+        if (df->status) {
+            failed++;
+        }
+        for (i = 0; i < Y_SIZE; i++) {
+            for (j = 0; j < X_SIZE; j++) {
+                for (d = 0; d < 4; d++) {
+                    target_data[i][j].d[d] = df->Data[i][j].d[d];
+                }
+                target_data[i][j].I = df->Data[i][j].I;
+            }
+        }
+#endif
+        if (index[n] >= 0
+            && memcmp(&feature_data[index[n]],
+                      target_data,
+                      sizeof(target_data))) {
+            mismatch++;
+        }
+
+        g++;
+        if (g % SOAK_REPORT == 0 || g == count) {
+            getrusage(RUSAGE_SELF, &ru);
+            fprintf(stderr,
+                    "%d %ld %d %d\n",
+                    g,
+                    ru.ru_maxrss,
+                    mismatch,
+                    failed);
+        }
+    }
+#ifdef THINNING
+    Extract_Feature_stats(stderr);
+#else
+    if (ctx != NULL) {
+        feature_ctx_finish(ctx);
+        free(ctx);
+    }
+#endif
+
+    for (n = 0; n < nlines; n++) {
+        free(names[n]);
+    }
+    free(names);
+    free(index);
+}
+
+/*
+ * カスケード探索の検証 (leave-one-outで全探索と結果を比較する)
+ */
+void
+recall(feature_db* db)
+{
+    DIRP(*feature_data)
+    [Y_SIZE][X_SIZE];
+    nn_query  q, r;
+    nn_query* qs;
+    int       n, m, nq, nitems, a, b;
+    int       match = 0, batch_match = 0;
+    long      evals = 0;
+    double    a_dist, b_dist;
+
+    if (db->magic != MAGIC_NO) {
+        return;
+    }
+    nitems = db->nitems;
+    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
+
+    fprintf(stderr, "# Comparing cascaded search with exhaustive search...\n");
+
+    for (n = 0; n < nitems; n++) {
+        nn_query_init(&q, &feature_data[n], n, NULL, db->knn);
+        nn_search(db, &q);
+        nn_query_init(&r, &feature_data[n], n, NULL, db->knn);
+        nn_search_exhaustive(db, &r);
+
+        evals += q.n_evals;
+        a = nn_vote(db, &q, &a_dist);
+        b = nn_vote(db, &r, &b_dist);
+        if (q.min_char_data == r.min_char_data && a == b) {
+            match++;
+        } else {
+            printf("mismatch: %d (%d, %f / %d, %f)\n", n, a, a_dist, b, b_dist);
+        }
+    }
+
+    // 一括探索 (RECALL_BATCH文字ずつ)
+    qs = (nn_query*)malloc(sizeof(nn_query) * RECALL_BATCH);
+    for (n = 0; n < nitems; n += nq) {
+        nq = MIN(RECALL_BATCH, nitems - n);
+        for (m = 0; m < nq; m++) {
+            nn_query_init(&qs[m], &feature_data[n + m], n + m, NULL, db->knn);
+        }
+        nn_search_batch(db, qs, nq);
+        for (m = 0; m < nq; m++) {
+            nn_query_init(&r, &feature_data[n + m], n + m, NULL, db->knn);
+            nn_search_exhaustive(db, &r);
+            a = nn_vote(db, &qs[m], &a_dist);
+            b = nn_vote(db, &r, &b_dist);
+            if (qs[m].min_char_data == r.min_char_data && a == b) {
+                batch_match++;
+            } else {
+                printf("batch mismatch: %d (%d, %f / %d, %f)\n",
+                       n + m,
+                       a,
+                       a_dist,
+                       b,
+                       b_dist);
+            }
+        }
+    }
+    free(qs);
+
+    printf("Recall = %g (= %d / %d )\n", (double)match / nitems, match, nitems);
+    printf("Batch recall = %g (= %d / %d )\n",
+           (double)batch_match / nitems,
+           batch_match,
+           nitems);
+    printf("Evaluated = %g (= %ld / %ld )\n",
+           (double)evals / ((long)nitems * (nitems - 1)),
+           evals,
+           (long)nitems * (nitems - 1));
 }
 
+/*
+ * k近傍法の評価
+ * (kごとに、leave-one-outの認識率と1文字あたりの探索時間を表示する)
+ */
 void
-distance(feature_db* db, char* lst_name)
+knn_bench(feature_db* db)
 {
-    double min_dist, dist;
-    int    min_char_data;
-    int    i, j, n, m;
-    int    correct;
-    int    miss;
-    int    nitems;
-    char   file_num[300];
     DIRP(*feature_data)
     [Y_SIZE][X_SIZE];
-    char* class_data;
+    char*    class_data;
+    nn_query q;
+    int      i, k, n, m, nitems, correct;
+    double   dist;
+    clock_t  start;
+    static const int ks[] = { 1, 3, 5, 7, 9, 11, 15 };
 
     if (db->magic != MAGIC_NO) {
         return;
@@ -1145,122 +3143,498 @@ distance(feature_db* db, char* lst_name)
     feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
     class_data = (char*)db + db->class_offset;
 
-    fprintf(stderr, "# Measuring distance to nearest stranger...\n");
-    fprintf(stderr, "%s\n", lst_name);
+    fprintf(stderr, "# Evaluating k-NN with leave-one-out...\n");
+    printf("k\tRecog-rate\tusec/query\n");
 
-    correct = miss = 0;
-    // 最近傍探索
-    for (n = 0; n < nitems; n++) {
-        min_char_data = -1;
-        min_dist = 1e10;
-        for (m = 0; m < nitems; m++) {
-            if (m == n || class_data[n] == class_data[m]) {
-                continue;
-            }
-            dist = DIRP_Dist(&feature_data[n], &feature_data[m]);
-            if (dist < min_dist) {
-                min_dist = dist;
-                min_char_data = m;
+    for (i = 0; i < (int)(sizeof(ks) / sizeof(ks[0])); i++) {
+        k = ks[i];
+        if (k > NN_MAX_K || k >= nitems) {
+            break;
+        }
+        correct = 0;
+        start = clock();
+        for (n = 0; n < nitems; n++) {
+            nn_query_init(&q, &feature_data[n], n, NULL, k);
+            nn_search(db, &q);
+            m = nn_vote(db, &q, &dist);
+            if (m >= 0 && class_data[m] == class_data[n]) {
+                correct++;
             }
         }
-        // 最小距離の表示
-        printf("%4.1f\t%c\t", min_dist, class_data[min_char_data]);
-        print_line(lst_name, n);
+        printf("%d\t%g (= %d / %d )\t%.1f\n",
+               k,
+               (double)correct / nitems,
+               correct,
+               nitems,
+               (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC / nitems);
     }
+}
 
-    fprintf(stderr,
-            "Recog-rate = %g (= %d / %d )\n",
-            (double)correct / nitems,
-            correct,
-            nitems);
+/*
+ * 縮約用: エントリsを保存する集合に加え、各エントリの最近傍を更新する
+ */
+static void
+condense_add(feature_db* db, int s, char* kept, int* nearest, double* near_d)
+{
+    DIRP(*feature_data)
+    [N][N];
+    int*      order;
+    int       n;
+    double    dist;
+    dist_func dist_f = db_dist(db);
+
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    order = (int*)((char*)db + db->order_offset);
+
+    kept[s] = TRUE;
+    for (n = 0; n < db->nitems; n++) {
+        if (n == s) {
+            continue;
+        }
+        dist = dist_f(&feature_data[n], &feature_data[s]);
+        if (nearest[n] < 0 || nn_farther(order, nearest[n], near_d[n], s, dist)) {
+            nearest[n] = s;
+            near_d[n] = dist;
+        }
+    }
 }
 
-void
-average(feature_db* db, char* lst_name)
+/*
+ * データベースの縮約 (Hartの方法で集合を作り、Gatesの方法で削る)
+ *
+ * 全エントリについて、保存した集合の中での最近傍 (自身は除く) のクラスが
+ * 元のデータベースでのleave-one-outの認識結果と一致するように選ぶ。
+ * 誤認識するエントリも含めて結果が一致するので、認識率は変わらない。
+ * kは1とする。
+ */
+static feature_db*
+condense(feature_db* db)
 {
-    double dist;
-    int    i, j, m, n, d, c;
-    int    nitems;
-    DIRP_D feature_sum[Y_SIZE][X_SIZE]; //クラスごとの特徴量の総和
-    DIRP   feature_ave[Y_SIZE][X_SIZE]; //クラスごとの特徴量の平均
     DIRP(*feature_data)
-    [Y_SIZE][X_SIZE];
-    char* class_data;
-    int   n_class;
-    bool  classes[256];
+    [N][N];
+    DIRP(*kept_data)
+    [N][N];
+    char*       class_data;
+    char*       kept_class;
+    char*       kept;
+    char*       meta;
+    char*       target; // 元のleave-one-outで認識したクラス
+    int *       order, *index, *orig_nn, *nearest, *trial, *affected;
+    double *    near_d, *trial_d;
+    int         i, j, k, n, m, s, t, nitems, nkept, naffected, changed, pass;
+    int         c, correct, small_correct, same;
+    double      dist, usec, small_usec;
+    clock_t     start;
+    dist_func   dist_f = db_dist(db);
+    feature_db* small;
+    nn_query    q;
 
     if (db->magic != MAGIC_NO) {
-        return;
+        return NULL;
     }
     nitems = db->nitems;
-    feature_data = (DIRP(*)[Y_SIZE][X_SIZE])((char*)db + db->feature_offset);
+    if (nitems < 2) {
+        // leave-one-outで最近傍が無い
+        fprintf(stderr, "too few entries to condense: %d\n", nitems);
+        return NULL;
+    }
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
     class_data = (char*)db + db->class_offset;
-
-    fprintf(stderr, "# Measuring average feature...\n");
-    fprintf(stderr, "%s\n", lst_name);
-
-    for (c = 0; c < 256; c++) {
-        classes[class_data[c]] = false; // classes[c]の間違い？
+    order = (int*)((char*)db + db->order_offset);
+
+    index = (int*)malloc(sizeof(int) * nitems);
+    orig_nn = (int*)malloc(sizeof(int) * nitems);
+    nearest = (int*)malloc(sizeof(int) * nitems);
+    trial = (int*)malloc(sizeof(int) * nitems);
+    affected = (int*)malloc(sizeof(int) * nitems);
+    near_d = (double*)malloc(sizeof(double) * nitems);
+    trial_d = (double*)malloc(sizeof(double) * nitems);
+    target = (char*)malloc(sizeof(char) * nitems);
+    kept = (char*)calloc(nitems, sizeof(char));
+    for (n = 0; n < nitems; n++) {
+        index[order[n]] = n;
+        nearest[n] = -1;
     }
 
+    fprintf(stderr, "# Condensing the database...\n");
+
+    // 元のデータベースでのleave-one-out
+    correct = 0;
+    start = clock();
     for (n = 0; n < nitems; n++) {
-        classes[class_data[n]] = true;
+        nn_query_init(&q, &feature_data[n], n, NULL, 1);
+        nn_search(db, &q);
+        orig_nn[n] = q.min_char_data;
+        target[n] = class_data[orig_nn[n]];
+        if (target[n] == class_data[n]) {
+            correct++;
+        }
+    }
+    usec = (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC / nitems;
+
+    // Hart: 結果が一致しないエントリがあれば、その本来の最近傍を加える
+    for (pass = 1, changed = TRUE; changed; pass++) {
+        changed = FALSE;
+        for (k = 0; k < nitems; k++) {
+            n = index[k];
+            if (nearest[n] >= 0 && class_data[nearest[n]] == target[n]) {
+                continue;
+            }
+            condense_add(db, orig_nn[n], kept, nearest, near_d);
+            changed = TRUE;
+        }
+        for (n = 0, nkept = 0; n < nitems; n++) {
+            nkept += kept[n];
+        }
+        fprintf(stderr, "Hart pass %d: %d entries\n", pass, nkept);
     }
 
-    for (c = 0; c < 256; c++) {
-        if (classes[c] == false) { //クラスが存在しない場合
+    // Gates: 除いても全エントリの結果が変わらないものを除く
+    for (k = nitems - 1; k >= 0; k--) {
+        s = index[k];
+        if (!kept[s]) {
             continue;
         }
+        kept[s] = FALSE;
 
-        // feature reset
-        for (i = 0; i < Y_SIZE; i++) {
-            for (j = 0; j < X_SIZE; j++) {
-                for (d = 0; d < 4; d++) {
-                    feature_sum[i][j].d[d] = 0;
+        naffected = 0;
+        for (n = 0; n < nitems; n++) {
+            if (nearest[n] != s) {
+                continue;
+            }
+            trial[n] = -1;
+            for (m = 0; m < nitems; m++) {
+                if (!kept[m] || m == n) {
+                    continue;
                 }
+                dist = dist_f(&feature_data[n], &feature_data[m]);
+                if (trial[n] < 0
+                    || nn_farther(order, trial[n], trial_d[n], m, dist)) {
+                    trial[n] = m;
+                    trial_d[n] = dist;
+                }
+            }
+            if (trial[n] < 0 || class_data[trial[n]] != target[n]) {
+                break;
             }
+            affected[naffected++] = n;
         }
 
-        // sum up
-        //クラスごとの特徴量の総和
-        n_class = 0;
-        for (n = 0; n < nitems; n++) {
-            if (class_data[n] != c) {
+        if (n < nitems) {
+            kept[s] = TRUE;
+            continue;
+        }
+        for (i = 0; i < naffected; i++) {
+            t = affected[i];
+            nearest[t] = trial[t];
+            near_d[t] = trial_d[t];
+        }
+    }
+
+    // 画像リストの順に詰める
+    for (n = 0, nkept = 0; n < nitems; n++) {
+        nkept += kept[n];
+    }
+    kept_data = (DIRP(*)[N][N])malloc(sizeof(DIRP[N][N]) * nkept);
+    kept_class = (char*)malloc(sizeof(char) * nkept);
+    for (k = 0, j = 0; k < nitems; k++) {
+        n = index[k];
+        trial[n] = -1;
+        if (kept[n]) {
+            memcpy(&kept_data[j], &feature_data[n], sizeof(DIRP[N][N]));
+            kept_class[j] = class_data[n];
+            trial[n] = j++;
+        }
+    }
+    meta = (char*)malloc(strlen(db_meta(db)) + 16);
+    sprintf(meta, "condensed: %s", db_meta(db));
+    small = db_pack(
+        kept_data, kept_class, nkept, db->channels, db->deskew, meta);
+    if (small == NULL) {
+        nkept = 0;
+    }
+
+    // 縮約後のデータベースで全エントリを認識して確かめる
+    for (m = 0; m < nkept; m++) {
+        affected[((int*)((char*)small + small->order_offset))[m]] = m;
+    }
+    same = small_correct = 0;
+    start = clock();
+    for (n = 0; n < nitems && nkept; n++) {
+        nn_query_init(&q,
+                      &feature_data[n],
+                      trial[n] < 0 ? -1 : affected[trial[n]],
+                      NULL,
+                      1);
+        nn_search(small, &q);
+        if (q.min_char_data < 0) {
+            // 残したのがn自身だけなら比べる相手が無い
+            continue;
+        }
+        c = ((char*)small + small->class_offset)[q.min_char_data];
+        same += c == target[n];
+        small_correct += c == class_data[n];
+    }
+    small_usec = (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC / nitems;
+
+    printf("Entries = %g (= %d / %d )\n", (double)nkept / nitems, nkept, nitems);
+    printf("Recog-rate = %g (= %d / %d ) -> %g (= %d / %d )\n",
+           (double)correct / nitems,
+           correct,
+           nitems,
+           (double)small_correct / nitems,
+           small_correct,
+           nitems);
+    printf("Same result = %g (= %d / %d )\n",
+           (double)same / nitems,
+           same,
+           nitems);
+    printf("usec/query = %.1f -> %.1f (x%.1f)\n",
+           usec,
+           small_usec,
+           usec / MAX(small_usec, 1e-3));
+
+    free(kept_data);
+    free(kept_class);
+    free(meta);
+    free(index);
+    free(orig_nn);
+    free(nearest);
+    free(trial);
+    free(affected);
+    free(near_d);
+    free(trial_d);
+    free(target);
+    free(kept);
+
+    return small;
+}
+
+/*
+ * クラスごとの代表パターン (k-means)
+ *
+ * 各クラスのエントリ (useが真のもの) をm個のクラスタに分け、その重心を
+ * エントリとするデータベースを作る。初期値は最初のエントリから順に、
+ * 既に選んだ代表から最も遠いエントリとする。エントリがm個以下のクラスは
+ * そのまま残す。useがNULLなら全エントリを用いる。
+ */
+static feature_db*
+prototype(feature_db* db, int m, char* use)
+{
+    DIRP(*feature_data)
+    [N][N];
+    DIRP(*proto)
+    [N][N];
+    class_info* cinfo;
+    char*       proto_class;
+    char        meta[300];
+    int *       members, *assign, *count;
+    double *    sum, *nearest;
+    double      dist, best;
+    int         c, i, j, n, p, r, d, nproto, nmembers, np, changed, iter;
+    dist_func   dist_f = db_dist(db);
+    feature_db* pdb;
+
+    if (db->magic != MAGIC_NO || m < 1) {
+        return NULL;
+    }
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    cinfo = (class_info*)((char*)db + db->cinfo_offset);
+
+    proto = (DIRP(*)[N][N])calloc(db->nitems, sizeof(DIRP[N][N]));
+    proto_class = (char*)malloc(sizeof(char) * db->nitems);
+    members = (int*)malloc(sizeof(int) * db->nitems);
+    assign = (int*)malloc(sizeof(int) * db->nitems);
+    count = (int*)malloc(sizeof(int) * m);
+    nearest = (double*)malloc(sizeof(double) * db->nitems);
+    sum = (double*)malloc(sizeof(double) * m * N * N * (CHANNELS + 1));
+
+    nproto = 0;
+    for (c = 0; c < db->nclasses; c++) {
+        nmembers = 0;
+        for (n = cinfo[c].start; n < cinfo[c].start + cinfo[c].count; n++) {
+            if (use == NULL || use[n]) {
+                members[nmembers++] = n;
+            }
+        }
+        if (nmembers == 0) {
+            continue;
+        }
+
+        // 初期値 (farthest-first)
+        np = MIN(m, nmembers);
+        for (i = 0; i < nmembers; i++) {
+            nearest[i] = 1e10;
+        }
+        for (p = 0, r = 0; p < np; p++) {
+            if (np == nmembers) {
+                r = p;
+            }
+            memcpy(&proto[nproto + p],
+                   &feature_data[members[r]],
+                   sizeof(DIRP[N][N]));
+            if (np == nmembers) {
                 continue;
             }
-            n_class++;
-            for (i = 0; i < Y_SIZE; i++) {
-                for (j = 0; j < X_SIZE; j++) {
-                    for (d = 0; d < 4; d++) {
-                        feature_sum[i][j].d[d] += feature_data[n][i][j].d[d];
-                    }
+            for (i = 0, r = 0, best = -1; i < nmembers; i++) {
+                dist = dist_f(&feature_data[members[i]], &proto[nproto + p]);
+                nearest[i] = MIN(nearest[i], dist);
+                if (nearest[i] > best) {
+                    best = nearest[i];
+                    r = i;
                 }
             }
         }
 
-        // calc average
-        //クラスごとの特徴量の平均
-        for (i = 0; i < Y_SIZE; i++) {
-            for (j = 0; j < X_SIZE; j++) {
-                for (d = 0; d < 4; d++) {
-                    feature_ave[i][j].d[d] =
-                        (int)(feature_sum[i][j].d[d] / n_class);
+        // Lloydの反復
+        for (iter = 0, changed = TRUE; np < nmembers && changed && iter < 20;
+             iter++) {
+            changed = FALSE;
+            for (i = 0; i < nmembers; i++) {
+                for (p = 0, r = 0, best = 1e10; p < np; p++) {
+                    dist = dist_f(&feature_data[members[i]], &proto[nproto + p]);
+                    if (dist < best) {
+                        best = dist;
+                        r = p;
+                    }
+                }
+                if (iter == 0 || assign[i] != r) {
+                    changed = TRUE;
+                }
+                assign[i] = r;
+            }
+
+            memset(count, 0, sizeof(int) * np);
+            memset(sum, 0, sizeof(double) * np * N * N * (CHANNELS + 1));
+            for (i = 0; i < nmembers; i++) {
+                DIRP(*A)
+                [N][N] = &feature_data[members[i]];
+                double* S = &sum[assign[i] * N * N * (CHANNELS + 1)];
+
+                count[assign[i]]++;
+                for (j = 0; j < N * N; j++) {
+                    S[j * (CHANNELS + 1)] += A[0][j / N][j % N].I;
+                    for (d = 0; d < db->channels; d++) {
+                        S[j * (CHANNELS + 1) + d + 1] +=
+                            A[0][j / N][j % N].d[d];
+                    }
+                }
+            }
+            for (p = 0; p < np; p++) {
+                DIRP(*G)
+                [N][N] = &proto[nproto + p];
+                double* S = &sum[p * N * N * (CHANNELS + 1)];
+
+                if (count[p] == 0) {
+                    // 空のクラスタは前回の代表のまま
+                    continue;
+                }
+                for (j = 0; j < N * N; j++) {
+                    G[0][j / N][j % N].I =
+                        (int)(S[j * (CHANNELS + 1)] / count[p] + 0.5);
+                    for (d = 0; d < db->channels; d++) {
+                        G[0][j / N][j % N].d[d] =
+                            (int)(S[j * (CHANNELS + 1) + d + 1] / count[p]
+                                  + 0.5);
+                    }
                 }
             }
         }
 
-        // print dist
-        for (n = 0; n < nitems; n++) {
-            if (class_data[n] != c) {
+        for (p = 0; p < np; p++) {
+            proto_class[nproto + p] = cinfo[c].label;
+        }
+        nproto += np;
+    }
+
+    snprintf(meta, sizeof(meta), "prototypes (M=%d): %s", m, db_meta(db));
+    pdb = db_pack(proto, proto_class, nproto, db->channels, db->deskew, meta);
+
+    free(proto);
+    free(proto_class);
+    free(members);
+    free(assign);
+    free(count);
+    free(nearest);
+    free(sum);
+
+    return pdb;
+}
+
+/*
+ * 代表パターン数ごとの評価
+ * (画像リストの偶数番目と奇数番目で2分割交差検定を行い、認識率と
+ *  1文字あたりの探索時間を表示する。allは全エントリを残した場合)
+ */
+static void
+prototype_bench(feature_db* db)
+{
+    DIRP(*feature_data)
+    [N][N];
+    char*       class_data;
+    char*       use;
+    int*        order;
+    feature_db* pdb;
+    nn_query    q;
+    int         i, f, n, m, entries, correct;
+    double      usec;
+    clock_t     start;
+    static const int ms[] = { 1, 2, 4, 8, 16, 32, 64, 0 };
+
+    if (db->magic != MAGIC_NO) {
+        return;
+    }
+    feature_data = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    class_data = (char*)db + db->class_offset;
+    order = (int*)((char*)db + db->order_offset);
+    use = (char*)malloc(sizeof(char) * db->nitems);
+
+    fprintf(stderr, "# Evaluating prototypes with 2-fold cross validation...\n");
+    printf("M\tEntries\tRecog-rate\tusec/query\n");
+
+    for (i = 0; i < (int)(sizeof(ms) / sizeof(ms[0])); i++) {
+        m = ms[i] ? ms[i] : db->nitems;
+        entries = correct = 0;
+        usec = 0;
+        for (f = 0; f < 2; f++) {
+            for (n = 0; n < db->nitems; n++) {
+                use[n] = order[n] % 2 != f;
+            }
+            pdb = prototype(db, m, use);
+            if (pdb == NULL) {
                 continue;
             }
+            entries += pdb->nitems;
+            start = clock();
+            for (n = 0; n < db->nitems; n++) {
+                if (use[n]) {
+                    continue;
+                }
+                nn_query_init(&q, &feature_data[n], -1, NULL, 1);
+                nn_search(pdb, &q);
+                if (((char*)pdb + pdb->class_offset)[q.min_char_data]
+                    == class_data[n]) {
+                    correct++;
+                }
+            }
+            usec += (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC;
+            free(pdb);
+        }
 
-            dist = DIRP_Dist(&feature_ave, &feature_data[n]);
-
-            printf("%4.1f\t", dist);
-            print_line(lst_name, n);
+        if (ms[i]) {
+            printf("%d", ms[i]);
+        } else {
+            printf("all");
         }
+        printf("\t%d\t%g (= %d / %d )\t%.1f\n",
+               entries / 2,
+               (double)correct / db->nitems,
+               correct,
+               db->nitems,
+               usec / db->nitems);
     }
+
+    free(use);
 }
 
 /* ============================================================
@@ -1347,6 +3721,60 @@ kocr_average(feature_db* db, char* lst_name)
     average(db, lst_name);
 }
 
+void
+kocr_soak(feature_db* db, char* lst_name, int count)
+{
+    if (db == NULL || lst_name == NULL) {
+        return;
+    }
+    soak(db, lst_name, count);
+}
+
+void
+kocr_recall(feature_db* db)
+{
+    if (db == NULL) {
+        return;
+    }
+    recall(db);
+}
+
+void
+kocr_knn_bench(feature_db* db)
+{
+    if (db == NULL) {
+        return;
+    }
+    knn_bench(db);
+}
+
+feature_db*
+kocr_condense(feature_db* db)
+{
+    if (db == NULL) {
+        return NULL;
+    }
+    return condense(db);
+}
+
+feature_db*
+kocr_prototype(feature_db* db, int m)
+{
+    if (db == NULL) {
+        return NULL;
+    }
+    return prototype(db, m, NULL);
+}
+
+void
+kocr_prototype_bench(feature_db* db)
+{
+    if (db == NULL) {
+        return;
+    }
+    prototype_bench(db);
+}
+
 #ifdef USE_SVM
 CvSVM*
 kocr_svm_init(char* filename)
@@ -1366,10 +3794,25 @@ kocr_svm_init(char* filename)
 feature_db*
 kocr_init(char* filename)
 {
+    feature_db* db;
+
     if (filename == NULL) {
         return NULL;
     }
-    return db_load(filename);
+    db = db_load(filename);
+#ifdef THINNING
+    // 認識はデータベースの傾き補正の方法で行うので、明示された方法と
+    // 異なるものは読み込まない
+    if (db != NULL && deskew_mode(db->deskew) != db->deskew) {
+        fprintf(stderr,
+                "database was built with deskew=%s, but KOCR_DESKEW=%s\n",
+                db_deskew_name(db->deskew),
+                getenv("KOCR_DESKEW"));
+        free(db);
+        return NULL;
+    }
+#endif
+    return db;
 }
 #endif
 
@@ -1380,12 +3823,25 @@ kocr_recognize_Image(CvSVM* db, IplImage* src_img)
 char*
 kocr_recognize_Image(feature_db* db, IplImage* src_img)
 #endif
+{
+    return kocr_recognize_Image_charset(db, src_img, NULL);
+}
+
+#ifdef USE_SVM
+char*
+kocr_recognize_Image_charset(CvSVM* db, IplImage* src_img, const char* charset)
+#else
+char*
+kocr_recognize_Image_charset(feature_db* db,
+                             IplImage*   src_img,
+                             const char* charset)
+#endif
 {
     if (db == NULL || src_img == NULL) {
         return NULL;
     }
 
-    return recog_image(db, src_img);
+    return recog_image(db, src_img, charset, 0);
 }
 
 #ifdef USE_SVM
@@ -1395,6 +3851,96 @@ kocr_recognize_image(CvSVM* db, char* file_name)
 char*
 kocr_recognize_image(feature_db* db, char* file_name)
 #endif
+{
+    return kocr_recognize_image_charset(db, file_name, NULL);
+}
+
+#ifdef USE_SVM
+char*
+kocr_recognize_image_charset(CvSVM* db, char* file_name, const char* charset)
+#else
+char*
+kocr_recognize_image_charset(feature_db* db,
+                             char*       file_name,
+                             const char* charset)
+#endif
+{
+    return recog_file(db, file_name, charset, 0);
+}
+
+#ifndef USE_SVM
+char*
+kocr_recognize_Image_knn(feature_db* db,
+                         IplImage*   src_img,
+                         const char* charset,
+                         int         k)
+{
+    if (db == NULL || src_img == NULL) {
+        return NULL;
+    }
+
+    return recog_image(db, src_img, charset, k);
+}
+
+char*
+kocr_recognize_image_knn(feature_db* db,
+                         char*       file_name,
+                         const char* charset,
+                         int         k)
+{
+    return recog_file(db, file_name, charset, k);
+}
+
+void
+kocr_set_knn(feature_db* db, int k)
+{
+    if (db == NULL) {
+        return;
+    }
+    db->knn = MAX(1, MIN(k, NN_MAX_K));
+}
+
+void
+kocr_info(feature_db* db)
+{
+    class_info* cinfo;
+    int         c;
+
+    if (db == NULL) {
+        return;
+    }
+    printf("version\t%d\n", db->version);
+    printf("entries\t%d\n", db->nitems);
+    printf("classes\t%d\n", db->nclasses);
+    printf("size\t%d x %d\n", db->n, db->n);
+    printf("channels\t%d\n", db->channels);
+    printf("thinning\t%s\n", db->thinning ? "yes" : "no");
+    if (db->thinning) {
+        printf("deskew\t%s\n", db_deskew_name(db->deskew));
+    }
+    printf("k\t%d\n", db->knn);
+    printf("meta\t%s\n", db_meta(db));
+
+    // クラスごとの統計 (探索の枝刈りに用いる)
+    cinfo = (class_info*)((char*)db + db->cinfo_offset);
+    printf("# class\tcount\tradius\tvariance\n");
+    for (c = 0; c < db->nclasses; c++) {
+        printf("%c\t%d\t%.1f\t%.1f\n",
+               cinfo[c].label,
+               cinfo[c].count,
+               cinfo[c].radius,
+               cinfo[c].variance);
+    }
+}
+#endif
+
+#ifdef USE_SVM
+static char*
+recog_file(CvSVM* db, char* file_name, const char* charset, int k)
+#else
+static char*
+recog_file(feature_db* db, char* file_name, const char* charset, int k)
+#endif
 {
     IplImage* src_img;
     char*     c;
@@ -1424,7 +3970,7 @@ kocr_recognize_image(feature_db* db, char* file_name)
         return NULL;
     }
 
-    c = recog_image(db, src_img);
+    c = recog_image(db, src_img, charset, k);
     cvReleaseImage(&src_img);
 
     return c;
@@ -35,7 +35,10 @@
 #define Y_SIZE 12
 #define X_SIZE 12
 int Extract_Feature_wrapper(char*, int[N][N][ANGLES]);
+int Extract_Feature_wrapper_deskew(char*, int[N][N][ANGLES], int);
 int Extract_Feature(cv::Mat, int[N][N][ANGLES]);
+int Extract_Feature_deskew(cv::Mat, int[N][N][ANGLES], int);
+void Extract_Feature_stats(FILE*);
 #else
 #define N      16
 #define Y_SIZE 16
@@ -49,6 +52,50 @@ int Extract_Feature(cv::Mat, int[N][N][ANGLES]);
 #define MAXCONTOUR 30 /* 輪郭を表す閉曲線の最大数 */
 #define MAGIC_NO   0xdeadbeaf
 
+#ifdef THINNING
+#define CHANNELS ANGLES /* 1画素あたりの方向特徴の数 */
+#else
+#define CHANNELS 4
+#endif
+
+#define DESKEW_NONE   0 /* 傾き補正をしない */
+#define DESKEW_ROTATE 1 /* 切り出した画像を回転する (細線化版の既定) */
+#define DESKEW_SHEAR  2 /* 正規化した画像をせん断する (高速) */
+#ifdef THINNING
+#define DESKEW_DEFAULT DESKEW_ROTATE
+#else
+#define DESKEW_DEFAULT DESKEW_NONE /* 細線化版以外は傾き補正をしない */
+#endif
+
+#define DB_VERSION    4          /* データベースの形式の版 */
+#define DB_BYTE_ORDER 0x01020304 /* バイト順の確認用 */
+#define DB_DTYPE_U8   1          /* 方向特徴の型: unsigned char */
+
+#define SUMMARY_N     4               /* 低解像度特徴の一辺 */
+#define SUMMARY_BLOCK (N / SUMMARY_N) /* 低解像度特徴1画素あたりの一辺 */
+#define DB_ALIGN(x)   (((x) + 7) & ~7)
+#define NPIVOTS       8    /* 三角不等式による枝刈りに用いるピボットの数 */
+#define DIST_EPS      1e-6 /* 三角不等式に用いる距離の丸め誤差に対する余裕 */
+
+#ifndef NN_PARALLEL_ITEMS
+#define NN_PARALLEL_ITEMS 20000 /* 最近傍探索を並列化するエントリ数の下限 */
+#endif
+#ifndef NN_MAX_THREADS
+#define NN_MAX_THREADS 8 /* 最近傍探索に用いる最大スレッド数 */
+#endif
+#define NN_TILE 64 /* 一括探索でまとめて扱うエントリ数 */
+#define NN_MAX_K 16 /* k近傍法のkの上限 */
+
+#define DIST_CACHE_MAGIC 0x6b646331 /* 距離のキャッシュの識別子 */
+#define DIST_CACHE_MAX   65000      /* 量子化した距離の最大値 */
+#ifndef DIST_CACHE_LIMIT
+#define DIST_CACHE_LIMIT (64L << 20) /* 距離のキャッシュの最大の大きさ */
+#endif
+
+#define SOAK_COUNT   100000 /* soakで特徴抽出する文字数の既定値 */
+#define SOAK_REPORT  10000  /* soakでメモリ使用量を出力する間隔 */
+#define RECALL_BATCH 16     /* recallで一括探索する文字数 */
+
 #define TRUE  1
 #define FALSE 0
 
@@ -87,10 +134,44 @@ typedef struct {
 } DIRP_D;
 
 typedef struct {
-    int magic;          //データベース識別のための変数
-    int nitems;         //データベースの画像数
-    int feature_offset; //データベースの特徴量の保存場所の先頭
-    int class_offset;   //データベースのクラスの保存場所の先頭
+    unsigned short d[SUMMARY_N][SUMMARY_N][4]; //方向特徴のブロック和
+} DIRP_S;
+
+typedef struct {
+    int    label;    //クラス (文字)
+    int    start;    //クラスに属する最初のエントリ
+    int    count;    //クラスに属するエントリ数
+    double radius;   //重心から最も遠いエントリまでの距離
+    double variance; //方向特徴の各次元の分散の和 (表示用)
+} class_info;
+
+typedef struct {
+    int magic;           //データベース識別のための変数
+    int nitems;          //データベースの画像数
+    int feature_offset;  //データベースの特徴量の保存場所の先頭
+    int class_offset;    //データベースのクラスの保存場所の先頭
+    int order_offset;    //各エントリの画像リスト上の順番の保存場所の先頭
+    int summary_offset;  //データベースの低解像度特徴の保存場所の先頭
+    int nclasses;        //クラス数
+    int cinfo_offset;    //クラスごとの範囲・半径の保存場所の先頭
+    int centroid_offset; //クラスごとの重心の保存場所の先頭
+    int npivots;         //ピボットの数
+    int pivot_offset;    //ピボットのエントリ番号の保存場所の先頭
+    int pdist_offset;    //各エントリからピボットへの距離の保存場所の先頭
+    int knn;             //k近傍法のk (1なら最近傍法)
+    int version;         //データベースの形式の版 (DB_VERSION)
+    int byte_order;      //作成した計算機のバイト順 (DB_BYTE_ORDER)
+    int header_size;     //このヘッダの大きさ
+    int n;               //特徴の一辺 (N)
+    int channels;        //距離計算に用いる方向特徴の数
+    int elem_size;       //1画素あたりのバイト数 (sizeof(DIRP))
+    int dtype;           //方向特徴の型 (DB_DTYPE_U8)
+    int align;           //各セクションの境界のバイト数
+    int thinning;        //細線化による特徴抽出で作成したか
+    int meta_offset;     //メタデータ (文字列) の保存場所の先頭
+    int length;          //データベース全体の大きさ
+    unsigned int checksum; //checksumを0として計算したデータベース全体のFNV-1a
+    int deskew;          //細線化版の傾き補正の方法 (DESKEW_*。他は0)
 } feature_db;
 
 typedef struct {
@@ -110,15 +191,15 @@ typedef struct {
 extern "C" {
 #endif
 #ifdef USE_SVM
-_EX_DECL char* recognize(CvSVM*, IplImage*);
+_EX_DECL char* recognize(CvSVM*, IplImage*, const char*, int);
 #else
-_EX_DECL char*       recognize(feature_db*, IplImage*);
+_EX_DECL char*       recognize(feature_db*, IplImage*, const char*, int);
 #endif
 
 #ifdef USE_SVM
-_EX_DECL char* recognize_multi(CvSVM*, IplImage*);
+_EX_DECL char* recognize_multi(CvSVM*, IplImage*, const char*, int);
 #else
-_EX_DECL char*       recognize_multi(feature_db*, IplImage*);
+_EX_DECL char*       recognize_multi(feature_db*, IplImage*, const char*, int);
 #endif
 
 _EX_DECL char* conv_fname(char*, const char*);
@@ -133,20 +214,39 @@ _EX_DECL feature_db* training(char*);
 _EX_DECL void        leave_one_out_test(feature_db*);
 #endif
 
-_EX_DECL void kocr_exclude(feature_db* db, char* lst_name);
-_EX_DECL void kocr_distance(feature_db* db, char* lst_name);
-_EX_DECL void kocr_average(feature_db* db, char* lst_name);
+_EX_DECL void        kocr_exclude(feature_db* db, char* lst_name);
+_EX_DECL void        kocr_distance(feature_db* db, char* lst_name);
+_EX_DECL void        kocr_average(feature_db* db, char* lst_name);
+_EX_DECL void        kocr_soak(feature_db* db, char* lst_name, int count);
+_EX_DECL void        kocr_recall(feature_db* db);
+_EX_DECL void        kocr_knn_bench(feature_db* db);
+_EX_DECL feature_db* kocr_condense(feature_db* db);
+_EX_DECL feature_db* kocr_prototype(feature_db* db, int m);
+_EX_DECL void        kocr_prototype_bench(feature_db* db);
 
 #ifdef USE_SVM
 _EX_DECL CvSVM* kocr_svm_init(char*);
 _EX_DECL void   kocr_svm_finish(CvSVM*);
 _EX_DECL char*  kocr_recognize_image(CvSVM*, char*);
 _EX_DECL char*  kocr_recognize_Image(CvSVM*, IplImage*);
+_EX_DECL char*  kocr_recognize_image_charset(CvSVM*, char*, const char*);
+_EX_DECL char*  kocr_recognize_Image_charset(CvSVM*, IplImage*, const char*);
 #else
 _EX_DECL feature_db* kocr_init(char* filename);
 _EX_DECL void        kocr_finish(feature_db* db);
 _EX_DECL char*       kocr_recognize_image(feature_db*, char*);
 _EX_DECL char*       kocr_recognize_Image(feature_db*, IplImage*);
+_EX_DECL char* kocr_recognize_image_charset(feature_db*, char*, const char*);
+_EX_DECL char* kocr_recognize_Image_charset(feature_db*,
+                                            IplImage*,
+                                            const char*);
+_EX_DECL char* kocr_recognize_image_knn(feature_db*, char*, const char*, int);
+_EX_DECL char* kocr_recognize_Image_knn(feature_db*,
+                                        IplImage*,
+                                        const char*,
+                                        int);
+_EX_DECL void  kocr_set_knn(feature_db*, int);
+_EX_DECL void  kocr_info(feature_db*);
 #endif
 
 #ifdef __cplusplus
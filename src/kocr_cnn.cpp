@@ -12,6 +12,7 @@
 #include "cropnums.h"
 #include "forward_cnn.h"
 #include "kocr_cnn.h"
+#include "downscale.h"
 
 cv::Mat
 preprocessing_for_cnn(cv::Mat img_src)
@@ -22,9 +23,24 @@ preprocessing_for_cnn(cv::Mat img_src)
 #endif
 
     /*
-     * 白黒画像取得
+     * 白黒画像取得 (大きすぎる入力は先に縮小する)
      */
-    cv::Mat img_bw = img_src.clone();
+    cv::Mat img_bw;
+    int     scaled_width, scaled_height;
+
+    if (downscale_size(img_src.cols,
+                       img_src.rows,
+                       &scaled_width,
+                       &scaled_height)) {
+        cv::resize(img_src,
+                   img_bw,
+                   cv::Size(scaled_width, scaled_height),
+                   0,
+                   0,
+                   cv::INTER_AREA);
+    } else {
+        img_bw = img_src.clone();
+    }
 
     if (img_src.channels() > 1) {
         cv::cvtColor(img_bw, img_bw, CV_BGR2GRAY);
@@ -94,8 +110,29 @@ preprocessing_for_cnn(cv::Mat img_src)
     return img_pad;
 }
 
+/*
+ * 認識対象の文字 (charset) に含まれるクラスだけを真とするマスク
+ * charsetがNULLのときは空 (制限なし)
+ */
+static std::vector<bool>
+charset_mask(Network* net, const char* charset)
+{
+    std::vector<bool> mask;
+
+    if (charset == NULL) {
+        return mask;
+    }
+    mask.resize(net->labels.size());
+    for (int i = 0; i < net->labels.size(); i++) {
+        const std::string& label = net->labels[i];
+        mask[i] = label.size() == 1 && label[0] != 0
+                  && strchr(charset, label[0]) != NULL;
+    }
+    return mask;
+}
+
 char*
-recognize(Network* net, IplImage* src_img)
+recognize(Network* net, IplImage* src_img, const char* charset)
 {
     std::vector<int> src_shape(4);
     src_shape[0] = 1;  // num of images
@@ -116,7 +153,12 @@ recognize(Network* net, IplImage* src_img)
     }
     src_mat.release();
 
-    std::string response = net->predict_labels(src_tensor)[0];
+    std::vector<bool> mask = charset_mask(net, charset);
+    std::string       response = net->predict_labels(src_tensor, mask)[0];
+    if (response.empty()) {
+        // 認識対象の文字が無い
+        return NULL;
+    }
 
 #ifndef LIBRARY
     printf("Recogized: %s\n", response.c_str());
@@ -126,7 +168,7 @@ recognize(Network* net, IplImage* src_img)
 }
 
 char*
-recognize_multi(Network* net, IplImage* src_img)
+recognize_multi(Network* net, IplImage* src_img, const char* charset)
 {
     IplImage* dst_img = NULL;
     CvRect    bb;
@@ -143,6 +185,8 @@ recognize_multi(Network* net, IplImage* src_img)
 
     Tensor<float> src_tensor(src_shape); // reuse this Tensor for all images
 
+    std::vector<bool> mask = charset_mask(net, charset);
+
     // 白黒に変換する(0,255の二値)
     dst_img = cvCreateImage(cvSize(src_img->width, src_img->height), 8, 1);
     cvThreshold(src_img, src_img, 120, 255, CV_THRESH_BINARY);
@@ -185,7 +229,12 @@ recognize_multi(Network* net, IplImage* src_img)
         }
         src_mat.release();
 
-        int response = net->predict_classes(src_tensor)[0];
+        int response = net->predict_classes(src_tensor, mask)[0];
+        if (response < 0) {
+            // 認識対象の文字が無い
+            free(result_str);
+            return NULL;
+        }
         result_str[seq_num] = (char)(response + '0');
         result_str[seq_num + 1] = 0;
 
@@ -201,14 +250,14 @@ recognize_multi(Network* net, IplImage* src_img)
 }
 
 char*
-recog_image(Network* net, IplImage* src_img)
+recog_image(Network* net, IplImage* src_img, const char* charset)
 {
     char* result;
 
     if (src_img->width / src_img->height > THRES_RATIO) {
-        result = recognize_multi(net, src_img);
+        result = recognize_multi(net, src_img, charset);
     } else {
-        result = recognize(net, src_img);
+        result = recognize(net, src_img, charset);
     }
     return result;
 }
@@ -286,6 +335,12 @@ kocr_cnn_finish(Network* net)
 
 char*
 kocr_recognize_image(Network* net, char* file_name)
+{
+    return kocr_recognize_image_charset(net, file_name, NULL);
+}
+
+char*
+kocr_recognize_image_charset(Network* net, char* file_name, const char* charset)
 {
     IplImage* src_img;
     char*     c;
@@ -312,7 +367,7 @@ kocr_recognize_image(Network* net, char* file_name)
         return NULL;
     }
 
-    c = recog_image(net, src_img);
+    c = recog_image(net, src_img, charset);
     cvReleaseImage(&src_img);
 
     return c;
@@ -320,10 +375,18 @@ kocr_recognize_image(Network* net, char* file_name)
 
 char*
 kocr_recognize_Image(Network* net, IplImage* src_img)
+{
+    return kocr_recognize_Image_charset(net, src_img, NULL);
+}
+
+char*
+kocr_recognize_Image_charset(Network*    net,
+                             IplImage*   src_img,
+                             const char* charset)
 {
     if (net == NULL || src_img == NULL) {
         return NULL;
     }
 
-    return recog_image(net, src_img);
+    return recog_image(net, src_img, charset);
 }
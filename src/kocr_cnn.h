@@ -6,9 +6,9 @@
 
 cv::Mat preprocessing_for_cnn(cv::Mat);
 
-char* recognize(Network*, IplImage*);
-char* recognize_multi(Network*, IplImage*);
-char* recog_image(Network*, IplImage*);
+char* recognize(Network*, IplImage*, const char*);
+char* recognize_multi(Network*, IplImage*, const char*);
+char* recog_image(Network*, IplImage*, const char*);
 
 // training is not implemented yet
 /*
@@ -38,6 +38,8 @@ _EX_DECL Network* kocr_cnn_init(char*);
 _EX_DECL void     kocr_cnn_finish(Network*);
 _EX_DECL char*    kocr_recognize_image(Network*, char*);
 _EX_DECL char*    kocr_recognize_Image(Network*, IplImage*);
+_EX_DECL char*    kocr_recognize_image_charset(Network*, char*, const char*);
+_EX_DECL char*    kocr_recognize_Image_charset(Network*, IplImage*, const char*);
 
 #ifdef __cplusplus
 }
@@ -100,6 +100,8 @@ usage()
 
 #ifdef USE_CNN
     printf(" kocr\tweights-file target\t\tRecognize characters in target\n");
+    printf("\tweights-file target charset\tRecognize only characters in "
+           "charset\n");
     printf("\n");
 
     printf("\tweights-file: *.bin\n");
@@ -107,8 +109,22 @@ usage()
     printf(" kocr\timage-list\t\tCreates a database file\n");
     printf("\tdatabase-file\t\tEvaluates a database file\n");
     printf("\tdatabase-file target\tRecognize characters in target\n");
+    printf("\tdatabase-file target charset\n");
+    printf("\t\t\t\tRecognize only characters in charset\n");
     printf("\n");
 
+#ifndef USE_SVM
+    printf("\tdatabase-file merge database-file ... -o output\n");
+    printf("\t\t\t\tMerge databases without re-extraction\n");
+    printf("\tdatabase-file append image-list ... [-o output]\n");
+    printf("\t\t\t\tAdd the images in image-list\n");
+    printf("\tdatabase-file condense [-o output]\n");
+    printf("\t\t\t\tRemove entries that never affect the results\n");
+    printf("\tdatabase-file prototype M [-o output]\n");
+    printf("\t\t\t\tReplace each class with M prototypes\n");
+    printf("\n");
+#endif
+
 #ifdef USE_SVM
     printf("\tdatabase-file: *.xml\n");
 #else
@@ -119,6 +135,153 @@ usage()
     printf("\ttarget: *.[png|pbm|jpg]\n\n");
 }
 
+#if !defined(USE_CNN) && !defined(USE_SVM)
+/* ============================================================
+ * データベースの結合・追加 (特徴量は再抽出しない)
+ *
+ *  kocr a.db merge b.db [c.db ...] -o out.db
+ *  kocr a.db append new.lst [...] [-o out.db]
+ *
+ * 結合では入力を上書きしないよう出力先を必須とする。追加で出力先を
+ * 省略するとa.dbを上書きする
+ * ============================================================ */
+static int
+merge_db(int argc, char* argv[])
+{
+    feature_db *db, *add, *merged;
+    char*       out_name = NULL;
+    int         i, ninputs = 0;
+    int         append = !strcmp("append", argv[2]);
+
+    // 読み込む前に引数を調べる (-oの後にはファイル名が要る)
+    for (i = 3; i < argc; i++) {
+        if (strcmp("-o", argv[i])) {
+            ninputs++;
+        } else if (i + 1 < argc) {
+            out_name = argv[++i];
+        } else {
+            // -oの後にファイル名が無い
+            usage();
+            return -1;
+        }
+    }
+    if (ninputs == 0 || (out_name == NULL && !append)) {
+        usage();
+        return -1;
+    }
+    if (out_name == NULL) {
+        out_name = argv[1];
+    }
+
+    db = db_load(argv[1]);
+    if (!db) {
+        return -1;
+    }
+
+    for (i = 3; i < argc; i++) {
+        if (!strcmp("-o", argv[i])) {
+            i++;
+            continue;
+        }
+        if (append) {
+            // 追加する画像のみ特徴抽出する
+            add = training(argv[i]);
+        } else {
+            add = db_load(argv[i]);
+        }
+        if (!add) {
+            free(db);
+            return -1;
+        }
+
+        merged = db_merge(db, add);
+        free(db);
+        free(add);
+        if (!merged) {
+            return -1;
+        }
+        db = merged;
+    }
+
+    i = db_save(out_name, db);
+    free(db);
+
+    return i;
+}
+
+/* ============================================================
+ * データベースの縮約
+ *
+ *  kocr a.db condense [-o out.db]
+ *
+ * 出力先を省略するとa-condensed.dbに保存する
+ * ============================================================ */
+static int
+condense_db(int argc, char* argv[])
+{
+    feature_db *db, *small;
+    char*       out_name;
+    int         r;
+
+    if (argc > 4 && !strcmp("-o", argv[3])) {
+        out_name = argv[4];
+    } else {
+        out_name = conv_fname(argv[1], "-condensed.db");
+    }
+
+    db = db_load(argv[1]);
+    if (!db) {
+        return -1;
+    }
+    small = kocr_condense(db);
+    free(db);
+    if (!small) {
+        return -1;
+    }
+
+    r = db_save(out_name, small);
+    free(small);
+
+    return r;
+}
+
+/* ============================================================
+ * クラスごとの代表パターンによるデータベース
+ *
+ *  kocr a.db prototype M [-o out.db]
+ *
+ * 出力先を省略するとa-prototype.dbに保存する
+ * ============================================================ */
+static int
+prototype_db(int argc, char* argv[])
+{
+    feature_db *db, *pdb;
+    char*       out_name;
+    int         r;
+
+    if (argc > 5 && !strcmp("-o", argv[4])) {
+        out_name = argv[5];
+    } else {
+        out_name = conv_fname(argv[1], "-prototype.db");
+    }
+
+    db = db_load(argv[1]);
+    if (!db) {
+        return -1;
+    }
+    pdb = kocr_prototype(db, atoi(argv[3]));
+    free(db);
+    if (!pdb) {
+        return -1;
+    }
+
+    r = db_save(out_name, pdb);
+    free(pdb);
+
+    return r;
+}
+#endif
+
 /* ============================================================
  * メイン関数
  * ============================================================ */
@@ -130,9 +293,12 @@ main(int argc, char* argv[])
 #ifdef USE_CNN
 
     Network* net;
-    char *   wf_name, *target;
+    char *   wf_name, *target, *charset = NULL;
 
     switch (argc) {
+    case 4:
+        // restrict the result to the characters in argv[3]
+        charset = argv[3];
     case 3:
         // set weights-file name to argv[1]
         wf_name = argv[1];
@@ -152,7 +318,7 @@ main(int argc, char* argv[])
     }
 
     // Character recognition
-    resultstr = kocr_recognize_image(net, target);
+    resultstr = kocr_recognize_image_charset(net, target, charset);
 
     printf("Result: %s\n", resultstr);
     free(resultstr);
@@ -163,7 +329,7 @@ main(int argc, char* argv[])
 
     // using SVM or Nearest Neighbor
 
-    char *      db_name, *lst_name;
+    char *      db_name, *lst_name, *charset = NULL;
     feature_db* db;
 
 #ifdef USE_SVM
@@ -192,6 +358,22 @@ main(int argc, char* argv[])
 
         exit(0);
     }
+
+    if (argc > 3 && is_database(argv[1])
+        && (!strcmp("merge", argv[2]) || !strcmp("append", argv[2]))) {
+        // Merge databases, or add images without re-extracting the others
+        exit(merge_db(argc, argv));
+    }
+
+    if (argc > 2 && is_database(argv[1]) && !strcmp("condense", argv[2])) {
+        // Keep only the entries needed for the same leave-one-out results
+        exit(condense_db(argc, argv));
+    }
+
+    if (argc > 3 && is_database(argv[1]) && !strcmp("prototype", argv[2])) {
+        // Replace the samples of each class with M prototypes
+        exit(prototype_db(argc, argv));
+    }
 #endif /* USE_SVM */
 
     switch (argc) {
@@ -219,6 +401,11 @@ main(int argc, char* argv[])
 #endif
         break;
 
+    case 4:
+        // argv[3] 認識対象の文字 (knnのときはk)
+        if (strcmp("knn", argv[2]) && strcmp("soak", argv[2])) {
+            charset = argv[3];
+        }
     case 3:
 
 #ifdef USE_SVM
@@ -230,7 +417,7 @@ main(int argc, char* argv[])
         }
 
         // Character recognition
-        resultstr = kocr_recognize_image(svm, argv[2]);
+        resultstr = kocr_recognize_image_charset(svm, argv[2], charset);
         if (!resultstr) {
             exit(-1);
         }
@@ -250,7 +437,12 @@ main(int argc, char* argv[])
             exit(-1);
         }
 
-        if (!strcmp("exclude", argv[2])) {
+        if (charset) {
+            // Character recognition restricted to charset
+            resultstr = kocr_recognize_image_charset(db, argv[2], charset);
+            printf("Result: %s\n", resultstr ? resultstr : "");
+            free(resultstr);
+        } else if (!strcmp("exclude", argv[2])) {
             // Exclude error files
             lst_name = conv_fname(argv[1], ".lst");
             kocr_exclude(db, lst_name);
@@ -258,10 +450,33 @@ main(int argc, char* argv[])
             // Calcurate distance to the average
             lst_name = conv_fname(argv[1], ".lst");
             kocr_average(db, lst_name);
+        } else if (!strcmp("soak", argv[2])) {
+            // Repeat feature extraction to check the memory usage
+            lst_name = conv_fname(argv[1], ".lst");
+            kocr_soak(db, lst_name, argc > 3 ? atoi(argv[3]) : 0);
         } else if (!strcmp("distance", argv[2])) {
             // Calcurate distance to the nearest neighbour
             lst_name = conv_fname(argv[1], ".lst");
             kocr_distance(db, lst_name);
+        } else if (!strcmp("recall", argv[2])) {
+            // Compare cascaded search with exhaustive search
+            kocr_recall(db);
+        } else if (!strcmp("knn", argv[2]) && argc > 3) {
+            // Set k of k-NN stored in the database
+            kocr_set_knn(db, atoi(argv[3]));
+            db_save(argv[1], db);
+        } else if (!strcmp("knn", argv[2])) {
+            // Evaluate k-NN for several k
+            kocr_knn_bench(db);
+        } else if (!strcmp("prototype", argv[2])) {
+            // Evaluate prototypes for several M
+            kocr_prototype_bench(db);
+        } else if (!strcmp("info", argv[2])) {
+            // Show the header of the database
+            kocr_info(db);
+        } else if (!strcmp("upgrade", argv[2])) {
+            // Rewrite the database in the current format
+            db_save(argv[1], db);
         } else {
             // Character recognition
             resultstr = kocr_recognize_image(db, argv[2]);
@@ -0,0 +1,171 @@
+/*
+ * pool.h
+ *
+ * Copyright (c) 2012, Seiichi Uchida. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 特徴抽出の作業領域のプール (subr.cpp, thinning.cppで共用)
+ *
+ * 借りた領域は返却しても解放せず、大きさを2のべき乗に切り上げて保持
+ * する。次に同じ大きさ以下の領域を借りるときはそれを貸し出すので、同じ
+ * ような大きさの画像を処理し続ける間はmallocしない。プールの中身は
+ * 0で初期化したものを使い、pool_finishで解放する。
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_SLOTS    16   /* 同時に借りられる領域の数 */
+#define POOL_MIN_SIZE 4096 /* 領域の大きさの最小値 */
+
+typedef struct {
+    void*    buf[POOL_SLOTS];  // 確保済みの領域
+    size_t   size[POOL_SLOTS]; // 領域の大きさ
+    int      used[POOL_SLOTS]; // 貸出中か
+    IplImage hdr[POOL_SLOTS];  // 画像として貸し出すときのヘッダ
+} scratch_pool;
+
+/*
+ * size以上の空き領域を選び、足りなければ確保し直す (空きが無ければ-1)
+ */
+static inline int
+pool_slot(scratch_pool* pool, size_t size)
+{
+    int    i, slot = -1;
+    size_t want = POOL_MIN_SIZE;
+
+    while (want < size) {
+        want <<= 1;
+    }
+
+    // 足りる中で最も小さい領域
+    for (i = 0; i < POOL_SLOTS; i++) {
+        if (!pool->used[i] && pool->size[i] >= want
+            && (slot < 0 || pool->size[i] < pool->size[slot])) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        // 足りる領域が無ければ、最も大きい空き領域を確保し直す
+        for (i = 0; i < POOL_SLOTS; i++) {
+            if (!pool->used[i]
+                && (slot < 0 || pool->size[i] > pool->size[slot])) {
+                slot = i;
+            }
+        }
+        if (slot < 0) {
+            return -1;
+        }
+        free(pool->buf[slot]);
+        pool->buf[slot] = malloc(want);
+        pool->size[slot] = pool->buf[slot] ? want : 0;
+        if (!pool->buf[slot]) {
+            return -1;
+        }
+    }
+    pool->used[slot] = TRUE;
+    return slot;
+}
+
+/*
+ * size バイトの領域を借りる (プールが一杯ならmallocする)
+ */
+static inline void*
+pool_get(scratch_pool* pool, size_t size)
+{
+    int slot = pool_slot(pool, size);
+
+    return (slot < 0) ? malloc(size) : pool->buf[slot];
+}
+
+static inline void
+pool_put(scratch_pool* pool, void* p)
+{
+    int i;
+
+    if (p == NULL) {
+        return;
+    }
+    for (i = 0; i < POOL_SLOTS; i++) {
+        if (pool->buf[i] == p) {
+            pool->used[i] = FALSE;
+            return;
+        }
+    }
+    free(p);
+}
+
+/*
+ * 画像を借りる (cvCreateImageと同じく画素は初期化しない)
+ */
+static inline IplImage*
+pool_image(scratch_pool* pool, CvSize size, int depth, int channels)
+{
+    IplImage hdr;
+    int      slot;
+
+    cvInitImageHeader(&hdr, size, depth, channels, 0, 4);
+    slot = pool_slot(pool, hdr.imageSize);
+    if (slot < 0) {
+        return cvCreateImage(size, depth, channels);
+    }
+    pool->hdr[slot] = hdr;
+    cvSetData(&pool->hdr[slot], pool->buf[slot], hdr.widthStep);
+    return &pool->hdr[slot];
+}
+
+static inline void
+pool_put_image(scratch_pool* pool, IplImage** img)
+{
+    int i;
+
+    if (*img == NULL) {
+        return;
+    }
+    for (i = 0; i < POOL_SLOTS; i++) {
+        if (*img == &pool->hdr[i]) {
+            pool->used[i] = FALSE;
+            *img = NULL;
+            return;
+        }
+    }
+    cvReleaseImage(img);
+}
+
+static inline void
+pool_finish(scratch_pool* pool)
+{
+    int i;
+
+    for (i = 0; i < POOL_SLOTS; i++) {
+        free(pool->buf[i]);
+        pool->buf[i] = NULL;
+        pool->size[i] = 0;
+        pool->used[i] = FALSE;
+    }
+}
+
+#endif /* POOL_H */
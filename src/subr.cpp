@@ -33,11 +33,13 @@
 #define _USE_MATH_DEFINES // M_PIとかを有効に
 
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -50,56 +52,72 @@
 #include "Labeling.h"
 #include "kocr.h"
 #include "subr.h"
+#include "blur.h"
+#include "downscale.h"
 
-/* sigma^2=4 */
 /*
- * static double Gausss[][5] = { {0.19947,0.17603,0.12099,0.06476,0.02700},
- * {0.17603,0.15535,0.10677,0.05715,0.02382},
- * {0.12099,0.10677,0.07338,0.03928,0.01637},
- * {0.06476,0.05715,0.03928,0.02102,0.00876},
- * {0.02700,0.02382,0.01637,0.00876,0.00365} };
+  関数をまたいで利用する変数はfeature_ctxにまとめてある。
+  extract_feature, extract_feature_wrapperは以下の共有の作業領域を用いる
+  ので、並行に呼ぶ場合は呼出し側で用意した作業領域を_r版に渡すこと。
  */
 
-/* sigma^2=2 */
-static double Gausss[][5] = {
-    {0.28209, 0.21970, 0.10378, 0.02973, 0.00517},
-    {0.21970, 0.17110, 0.08082, 0.02316, 0.00402},
-    {0.10378, 0.08082, 0.03818, 0.01094, 0.00190},
-    {0.02973, 0.02316, 0.01094, 0.00313, 0.00054},
-    {0.00517, 0.00402, 0.00190, 0.00054, 0.00009}
-};
-
-/*-------------------------------------------------------------------*
- * Global Variables
- *-------------------------------------------------------------------*/
-/* 分散σ^2=4のガウス分布(正規化項は無し) */
-static double Gauss[][5] = {
-    {1.0000, 0.8825, 0.6065, 0.3247, 0.1353},
-    {0.8825, 0.7788, 0.5353, 0.2865, 0.1194},
-    {0.6065, 0.5353, 0.3679, 0.1969, 0.0821},
-    {0.3247, 0.2865, 0.1969, 0.1054, 0.0439},
-    {0.1353, 0.1194, 0.0821, 0.0439, 0.0183}
-};
-
-typedef struct {
-    unsigned char x;
-    unsigned char y;
-    unsigned char nu;
-    double        d;
-} SORT;
+static feature_ctx shared_ctx;
+
+static pthread_key_t  ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
 
 /*
-  以下の変数はこのファイル内で、関数をまたいで利用している。
-  外部のファイルへの値の受渡しは、dfのみを用いている。
+ * 作業領域の解放 (feature_ctx自体は解放しない)
  */
+void
+feature_ctx_finish(feature_ctx* ctx)
+{
+    int i;
+
+    for (i = 0; i < MAXCONTOUR; i++) {
+        free(ctx->Cont[i]);
+        ctx->Cont[i] = NULL;
+        ctx->ContCap[i] = 0;
+    }
+    pool_finish(&ctx->pool);
+    if (ctx->element != NULL) {
+        cvReleaseStructuringElement(&ctx->element);
+    }
+}
+
+static void
+ctx_destroy(void* p)
+{
+    feature_ctx_finish((feature_ctx*)p);
+    free(p);
+}
 
-static unsigned char ContImg[64][64];
-static unsigned char DirPat[4][N][N];
-static double        Blur[4][N][N];
-static short         ContLen[MAXCONTOUR];
-static double        Blur_I[N][N];
-static Contour*      Cont[MAXCONTOUR];
-static datafolder    df;
+static void
+ctx_key_create()
+{
+    pthread_key_create(&ctx_key, ctx_destroy);
+}
+
+/*
+ * 呼び出したスレッド専用の作業領域 (スレッドの終了時に解放される)
+ * 確保できなければNULLを返すので、呼出し側は認識を失敗とすること
+ */
+feature_ctx*
+feature_ctx_thread()
+{
+    feature_ctx* ctx;
+
+    pthread_once(&ctx_once, ctx_key_create);
+    ctx = (feature_ctx*)pthread_getspecific(ctx_key);
+    if (ctx == NULL) {
+        ctx = (feature_ctx*)calloc(1, sizeof(feature_ctx));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        pthread_setspecific(ctx_key, ctx);
+    }
+    return ctx;
+}
 
 /*===================================================================*
  * 4) 輪郭抽出
@@ -108,7 +126,7 @@ static datafolder    df;
  * cf. 尾崎,谷口,"画像処理--その基礎から応用まで(2nd ed)",pp.211
  *===================================================================*/
 short
-Contour_Detect(IplImage* Normalized)
+Contour_Detect(feature_ctx* ctx, IplImage* Normalized)
 {
     short         k, l;
     short         start_k, start_l;
@@ -124,7 +142,7 @@ Contour_Detect(IplImage* Normalized)
     /* Initialize */
     for (k = 0; k < 64; k++)
         for (l = 0; l < 64; l++) {
-            ContImg[k][l] = BG;
+            ctx->ContImg[k][l] = BG;
         }
 
     /* Scanning */
@@ -139,15 +157,19 @@ Contour_Detect(IplImage* Normalized)
                         ->imageData[Normalized->widthStep * (l - 1) + k];
             if (((pixelval1 == FG && l == 0)
                  || (pixelval1 == FG && pixelval2 == BG))
-                && (ContImg[k][l] == BG)) {
+                && (ctx->ContImg[k][l] == BG)) {
                 /* 端点発見 (p_0) */
                 last_k = front_k = start_k = k;
                 last_l = front_l = start_l = l;
 
                 contlen = 0;
-                Cont[contnum] = (Contour*)calloc(100, sizeof(Contour));
-                Cont[contnum][contlen].x = start_k;
-                Cont[contnum][contlen].y = start_l;
+                if (ctx->ContCap[contnum] == 0) {
+                    ctx->ContCap[contnum] = 100;
+                    ctx->Cont[contnum] =
+                        (Contour*)malloc(100 * sizeof(Contour));
+                }
+                ctx->Cont[contnum][contlen].x = start_k;
+                ctx->Cont[contnum][contlen].y = start_l;
                 contlen++;
 
                 /*
@@ -181,7 +203,7 @@ Contour_Detect(IplImage* Normalized)
                                 ->imageData[Normalized->widthStep * front_l
                                             + front_k];
                         if (pixelval1 == FG) {
-                            ContImg[front_k][front_l] = FG;
+                            ctx->ContImg[front_k][front_l] = FG;
                             last_k = front_k;
                             last_l = front_l;
                             break;
@@ -192,20 +214,20 @@ Contour_Detect(IplImage* Normalized)
                     if ((last_k == start_k) && (last_l == start_l)) {
                         break; /* from while(1) */
                     } else {
-                        Cont[contnum][contlen].x = front_k;
-                        Cont[contnum][contlen].y = front_l;
+                        ctx->Cont[contnum][contlen].x = front_k;
+                        ctx->Cont[contnum][contlen].y = front_l;
                         contlen++;
 
-                        if (((contlen + 1) % 100) == 0) {
-                            Cont[contnum] = (Contour*)realloc(
-                                Cont[contnum],
-                                (((contlen + 1) / 100 + 1) * 100)
-                                    * sizeof(Contour));
+                        if (contlen + 1 >= ctx->ContCap[contnum]) {
+                            ctx->ContCap[contnum] *= 2;
+                            ctx->Cont[contnum] = (Contour*)realloc(
+                                ctx->Cont[contnum],
+                                ctx->ContCap[contnum] * sizeof(Contour));
                         }
                     }
                 } /* the end of while */
 
-                ContLen[contnum] = contlen;
+                ctx->ContLen[contnum] = contlen;
                 contnum++;
                 if (contnum == MAXCONTOUR) {
                     fprintf(stderr, "Too many contours (>30)are detected.\n");
@@ -215,7 +237,7 @@ Contour_Detect(IplImage* Normalized)
         }
     }
 
-    /* freeしていない */
+    /* Cont[]はctxに残し、次の呼出しで再利用する */
 
     return contnum;
 }
@@ -227,21 +249,21 @@ Contour_Detect(IplImage* Normalized)
  *     よる解析", 信学論,Vol.J65-D, No.5, 1982, Section3.2.1
  *===================================================================*/
 void
-Contour_To_Directional_Pattern(short contnum)
+Contour_To_Directional_Pattern(feature_ctx* ctx, short contnum)
 {
-    short  c, l, x, y;
+    short  c, l, x, y, len;
     short  x1, y1, x2, y2;
     double theta;
     short  d, nu;
 
-    for (nu = 0; nu < 4; nu++)
-        for (x = 0; x < N; x++)
-            for (y = 0; y < N; y++) {
-                DirPat[nu][x][y] = 0;
+    for (x = 0; x < N; x++)
+        for (y = 0; y < N; y++)
+            for (nu = 0; nu < 4; nu++) {
+                ctx->DirPat[x][y][nu] = 0;
             }
 
     for (c = 0; c < contnum; c++) {
-        for (l = 0; l < ContLen[c]; l++) {
+        for (l = 0; l < ctx->ContLen[c]; l++) {
             /*
              * まず輪郭線の各点での方向θを求める。
              *
@@ -249,10 +271,11 @@ Contour_To_Directional_Pattern(short contnum)
              *     ○←●←○←◎←○←●←○
              *
              */
-            x1 = Cont[c][(l + SMOOTHING_STEP) % ContLen[c]].x;
-            y1 = Cont[c][(l + SMOOTHING_STEP) % ContLen[c]].y;
-            x2 = Cont[c][(l - SMOOTHING_STEP + ContLen[c]) % ContLen[c]].x;
-            y2 = Cont[c][(l - SMOOTHING_STEP + ContLen[c]) % ContLen[c]].y;
+            len = ctx->ContLen[c];
+            x1 = ctx->Cont[c][(l + SMOOTHING_STEP) % len].x;
+            y1 = ctx->Cont[c][(l + SMOOTHING_STEP) % len].y;
+            x2 = ctx->Cont[c][(l - SMOOTHING_STEP + len) % len].x;
+            y2 = ctx->Cont[c][(l - SMOOTHING_STEP + len) % len].y;
 
             theta = atan2((double)(x2 - x1), (double)(y2 - y1));
             if (ABS(theta) == M_PI) {
@@ -273,14 +296,14 @@ Contour_To_Directional_Pattern(short contnum)
              *         ／｜＼
              *       ／  ｜  ＼
              */
-            x = (Cont[c][l].x * N) / 64;
-            y = (Cont[c][l].y * N) / 64;
+            x = (ctx->Cont[c][l].x * N) / 64;
+            y = (ctx->Cont[c][l].y * N) / 64;
 
             if (d % 2) {
-                DirPat[nu][x][y] += 2;
+                ctx->DirPat[x][y][nu] += 2;
             } else {
-                DirPat[nu][x][y] += 1;
-                DirPat[(nu + 1) % 4][x][y] += 1;
+                ctx->DirPat[x][y][nu] += 1;
+                ctx->DirPat[x][y][(nu + 1) % 4] += 1;
             }
         }
     }
@@ -291,10 +314,10 @@ Contour_To_Directional_Pattern(short contnum)
  *  gauss(x,y) = exp(-(x^2+y^2)/(2σ^2))
  *===================================================================*/
 void
-Blurring()
+Blurring(feature_ctx* ctx)
 {
-    short  x, y, i, j, nu;
-    double total_weight, weight;
+    short  x, y, nu;
+    double total_weight, wsum[N], ratio;
 
 #ifdef DEBUG_FILE
     FILE*         fp;
@@ -302,142 +325,151 @@ Blurring()
     char          fname[100];
 #endif
 
-    total_weight = 0;
-    for (i = -4; i <= 4; i++)
-        for (j = -4; j <= 4; j++) {
-            total_weight += Gauss[ABS(i)][ABS(j)];
+    // 画像の端では範囲内の重みの和で割り、端にかからない場合にそろえる
+    total_weight = blur_border(blur_gauss4, 4, wsum);
+    blur_separable(&ctx->DirPat[0][0][0],
+                   &ctx->Blur[0][0][0],
+                   4,
+                   blur_gauss4,
+                   4);
+    for (x = 0; x < N; x++) {
+        for (y = 0; y < N; y++) {
+            ratio = (total_weight * total_weight) / (wsum[x] * wsum[y]);
+            for (nu = 0; nu < 4; nu++) {
+                ctx->Blur[x][y][nu] *= ratio;
+            }
         }
+    }
+}
 
-    for (nu = 0; nu < 4; nu++) {
-        for (x = 0; x < N; x++) {
-            for (y = 0; y < N; y++) {
-                Blur[nu][x][y] = 0.0;
-                weight = 0.0;
-                for (i = -4; i <= 4; i++) {
-                    for (j = -4; j <= 4; j++) {
-                        if ((x + i >= 0) && (x + i < N)) {
-                            if ((y + j >= 0) && (y + j < N)) {
-                                Blur[nu][x][y] +=
-                                    (double)DirPat[nu][x + i][y + j]
-                                    * Gauss[ABS(i)][ABS(j)];
-                                weight += Gauss[ABS(i)][ABS(j)];
-                            }
-                        }
-                    }
-                }
-                Blur[nu][x][y] *= ((double)total_weight / (double)weight);
-            }
+/*===================================================================*
+ * 平坦化のための順位付け
+ *
+ * ctx->rkey[0..n-1]を小さい順に並べた添字を返す。キーは非負のdoubleの
+ * ビット列で、符号なし整数とみなしても大小関係は変わらないので、8ビット
+ * ずつのLSD基数ソートで並べる。基数ソートは安定なので同じ値は添字の
+ * 小さい方が先になり、以前の (glibcの安定な) qsortと同じ順位になる。
+ *===================================================================*/
+static unsigned long long
+Rank_Key(double d)
+{
+    unsigned long long key;
+
+    d += 0.0; // -0.0を0.0にそろえる
+    memcpy(&key, &d, sizeof(key));
+    return key;
+}
+
+static unsigned short*
+Rank_Keys(feature_ctx* ctx, int n)
+{
+    int             count[8][256];
+    unsigned short* src = ctx->rorder[0];
+    unsigned short* dst = ctx->rorder[1];
+    unsigned short* tmp;
+    int             i, b, c, sum;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+        for (b = 0; b < 8; b++) {
+            count[b][(ctx->rkey[i] >> (b * 8)) & 0xff]++;
         }
+        src[i] = (unsigned short)i;
     }
+
+    for (b = 0; b < 8; b++) {
+        // 全てのキーでこの桁が同じなら並べ替えなくてよい
+        if (count[b][(ctx->rkey[0] >> (b * 8)) & 0xff] == n) {
+            continue;
+        }
+        sum = 0;
+        for (i = 0; i < 256; i++) {
+            c = count[b][i];
+            count[b][i] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n; i++) {
+            dst[count[b][(ctx->rkey[src[i]] >> (b * 8)) & 0xff]++] = src[i];
+        }
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    return src;
 }
 
 /*===================================================================*
  * 輝度値ヒストグラム平坦化
  *===================================================================*/
 void
-Equalize_Intensity()
+Equalize_Intensity(feature_ctx* ctx)
 {
-    short i, j;
-    long  k;
-    short step = N * N / 256;
-    SORT* sortbuf;
-
-    sortbuf = (SORT*)calloc(N * N, sizeof(SORT));
+    short           i, j;
+    long            k;
+    short           step = MAX(1, N * N / 256);
+    unsigned short* order;
 
     /* 輝度値一様化 */
     k = 0;
     for (i = 0; i < N; i++) {
         for (j = 0; j < N; j++) {
-            sortbuf[k].x = (unsigned char)i;
-            sortbuf[k].y = (unsigned char)j;
-            sortbuf[k].d = Blur_I[i][j];
-            k++;
+            ctx->rkey[k++] = Rank_Key(ctx->Blur_I[i][j]);
         }
     }
-    qsort((void*)sortbuf, N * N, sizeof(SORT), Compare);
-    i = 0;
-    for (k = 0; k < (N * N); k += step) {
+    order = Rank_Keys(ctx, N * N);
+    for (k = 0; k < (N * N); k++) {
 #ifdef DEBUG
-        if (i > 255) {
+        if (k / step > 255) {
             fprintf(stderr, "STRANGE value\n");
         }
 #endif
-        for (j = 0; j < step; j++) {
-            df.Data[sortbuf[k + j].x][sortbuf[k + j].y].I = (unsigned char)i;
-        }
-        i++;
+        i = order[k] / N;
+        j = order[k] % N;
+        ctx->df.Data[i][j].I = (unsigned char)(k / step);
     }
-
-    free(sortbuf);
 }
 
 /*===================================================================*
  * 方向特徴ヒストグラム平坦化
  *===================================================================*/
 void
-Equalize_Directional_Pattern()
+Equalize_Directional_Pattern(feature_ctx* ctx)
 {
-    short         i, j;
-    unsigned char nu;
-    long          k;
-    short         step = N * N * 4 / 256;
-    SORT*         sortbuf;
-
-    sortbuf = (SORT*)calloc(N * N * 4, sizeof(SORT));
+    short           i, j;
+    unsigned char   nu;
+    long            k;
+    short           step = N * N * 4 / 256;
+    unsigned short* order;
 
     /* 方向特徴ヒストグラム一様化 */
     k = 0;
     for (i = 0; i < N; i++) {
         for (j = 0; j < N; j++) {
             for (nu = 0; nu < 4; nu++) {
-                sortbuf[k].x = (unsigned char)i;
-                sortbuf[k].y = (unsigned char)j;
-                sortbuf[k].nu = nu;
-                sortbuf[k].d = Blur[nu][i][j];
-                k++;
+                ctx->rkey[k++] = Rank_Key(ctx->Blur[i][j][nu]);
             }
         }
     }
-    qsort((char*)sortbuf, N * N * 4, sizeof(SORT), Compare);
-    i = 0;
-    for (k = 0; k < (N * N * 4); k += step) {
+    order = Rank_Keys(ctx, N * N * 4);
+    for (k = 0; k < (N * N * 4); k++) {
 #ifdef DEBUG
-        if (i > 255) {
+        if (k / step > 255) {
             fprintf(stderr, "STRANGE\n");
         }
 #endif
-        for (j = 0; j < step; j++)
-            df.Data[sortbuf[k + j].x][sortbuf[k + j].y].d[sortbuf[k + j].nu] =
-                (unsigned char)i;
-        i++;
-    }
-
-    free(sortbuf);
-}
-
-/*==================================================================*
- * qsort用比較関数
- *==================================================================*/
-int
-Compare(const void* i, const void* j)
-{
-    // ちょっと心配
-    // printf("%g, ", ((SORT *) i)->d);
-
-    if (((SORT*)i)->d > ((SORT*)j)->d) {
-        return (1);
-    }
-    if (((SORT*)i)->d < ((SORT*)j)->d) {
-        return (-1);
+        i = order[k] / (N * 4);
+        j = order[k] / 4 % N;
+        nu = order[k] % 4;
+        ctx->df.Data[i][j].d[nu] = (unsigned char)(k / step);
     }
-    return (0);
 }
 
 /*===================================================================*
  * データ出力
  *===================================================================*/
 void
-Make_Intensity(IplImage* Normalized)
+Make_Intensity(feature_ctx* ctx, IplImage* Normalized)
 {
     short         i, j, x, y;
     unsigned char pixelval;
@@ -445,7 +477,7 @@ Make_Intensity(IplImage* Normalized)
     /* 画素値に関して、64x64->16x16 */
     for (i = 0; i < N; i++)
         for (j = 0; j < N; j++) {
-            df.Data[i][j].I = 0;
+            ctx->df.Data[i][j].I = 0;
         }
 
     for (x = 0; x < 64; x++) {
@@ -455,7 +487,7 @@ Make_Intensity(IplImage* Normalized)
             pixelval = (unsigned char)
                            Normalized->imageData[Normalized->widthStep * y + x];
             if (pixelval == FG) {
-                df.Data[i][j].I++;
+                ctx->df.Data[i][j].I++;
             }
         }
     }
@@ -463,47 +495,36 @@ Make_Intensity(IplImage* Normalized)
     for (i = 0; i < N; i++) {
         for (j = 0; j < N; j++) {
             /* 対応する黒画素が3つ以上の時、黒画素とする */
-            if (df.Data[i][j].I > 2) {
-                df.Data[i][j].I = 255;
+            if (ctx->df.Data[i][j].I > 2) {
+                ctx->df.Data[i][j].I = 255;
             } else {
-                df.Data[i][j].I = 0;
+                ctx->df.Data[i][j].I = 0;
             }
         }
     }
 }
 
 /*===================================================================*
- * (6) ガウス関数(σ^2=4)による輝度値のボケ変換
+ * (6) ガウス関数(σ^2=2)による輝度値のボケ変換
  *  Gauss(x,y) = exp(-(x^2+y^2)/(2σ^2))
  *===================================================================*/
 void
-Blur_Intensity()
+Blur_Intensity(feature_ctx* ctx)
 {
-    short  x, y, i, j;
-    double total_weight, weight;
+    short  x, y;
+    int    src[N][N];
+    double wsum[N];
 
-    total_weight = 0;
-    for (i = -4; i <= 4; i++)
-        for (j = -4; j <= 4; j++) {
-            total_weight += Gausss[ABS(i)][ABS(j)];
+    for (x = 0; x < N; x++) {
+        for (y = 0; y < N; y++) {
+            src[x][y] = ctx->df.Data[x][y].I;
         }
-
+    }
+    blur_border(blur_gauss2, 4, wsum);
+    blur_separable(&src[0][0], &ctx->Blur_I[0][0], 1, blur_gauss2, 4);
     for (x = 0; x < N; x++) {
         for (y = 0; y < N; y++) {
-            Blur_I[x][y] = 0.0;
-            weight = 0.0;
-            for (i = -4; i <= 4; i++) {
-                for (j = -4; j <= 4; j++) {
-                    if ((x + i >= 0) && (x + i < N)) {
-                        if ((y + j >= 0) && (y + j < N)) {
-                            Blur_I[x][y] += (double)(df.Data[x + i][y + j].I)
-                                          * Gausss[ABS(i)][ABS(j)];
-                            weight += Gausss[ABS(i)][ABS(j)];
-                        }
-                    }
-                }
-            }
-            Blur_I[x][y] /= (double)weight;
+            ctx->Blur_I[x][y] /= wsum[x] * wsum[y];
         }
     }
 }
@@ -531,30 +552,114 @@ DIRP_Dist(DIRP (*A)[N][N], DIRP (*B)[N][N])
     return (sqrt(dist));
 }
 
+/*===================================================================*
+ * 全ての方向特徴 (CHANNELS個) を用いた２パターン間の距離
+ *===================================================================*/
+double
+DIRP_Dist_All(DIRP (*A)[N][N], DIRP (*B)[N][N])
+{
+    int    i, j, d, diff;
+    double dist = 0.0;
+
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < N; j++) {
+            for (d = 0; d < CHANNELS; d++) {
+                diff = (int)A[0][i][j].d[d] - (int)B[0][i][j].d[d];
+                dist += diff * diff;
+            }
+        }
+    }
+
+    return (sqrt(dist));
+}
+
+/*===================================================================*
+ * 低解像度特徴の生成 (方向特徴をSUMMARY_BLOCK四方ごとに足し合わせる)
+ *===================================================================*/
+void
+DIRP_Summarize(DIRP (*A)[N][N], DIRP_S* S)
+{
+    int i, j, d;
+
+    memset(S, 0, sizeof(*S));
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < N; j++) {
+            for (d = 0; d < 4; d++) {
+                S->d[i / SUMMARY_BLOCK][j / SUMMARY_BLOCK][d] +=
+                    A[0][i][j].d[d];
+            }
+        }
+    }
+}
+
+/*===================================================================*
+ * 低解像度特徴から求めた、DIRP_Distの下界
+ *
+ * ブロック内の差の和をs、ブロック内の画素数をkとすると、
+ * Cauchy-Schwarzの不等式より s^2 / k <= (ブロック内の差の二乗和)
+ *===================================================================*/
+double
+DIRP_Bound(DIRP_S* A, DIRP_S* B)
+{
+    int  i, j, d, diff;
+    long dist = 0;
+
+    for (i = 0; i < SUMMARY_N; i++) {
+        for (j = 0; j < SUMMARY_N; j++) {
+            for (d = 0; d < 4; d++) {
+                diff = (int)A->d[i][j][d] - (int)B->d[i][j][d];
+                dist += diff * diff;
+            }
+        }
+    }
+
+    return (sqrt((double)dist / (SUMMARY_BLOCK * SUMMARY_BLOCK)));
+}
+
 /*===================================================================*
  * 特徴抽出ルーチン
  *===================================================================*/
 
 void
 extract_feature_wrapper(char* fname, datafolder** retdf)
+{
+    extract_feature_wrapper_r(&shared_ctx, fname, retdf);
+}
+
+int
+extract_feature(IplImage* org_img, datafolder** retdf)
+{
+    return extract_feature_r(&shared_ctx, org_img, retdf);
+}
+
+/*
+ * 作業領域ctxを用いる特徴抽出 (ctxを共有しなければ並行に呼んでよい)
+ *
+ * *retdfにはctx内の結果を返すので、ctxを再利用するまでに読み出すこと。
+ * 作業用の画像はctxのプールから借りるので、同じ大きさの画像を続けて
+ * 処理する間はメモリを確保しない。org_imgは解放しない。
+ */
+void
+extract_feature_wrapper_r(feature_ctx* ctx, char* fname, datafolder** retdf)
 {
     int ret;
 
     IplImage* org_img =
         cvLoadImage(fname, CV_LOAD_IMAGE_ANYDEPTH | CV_LOAD_IMAGE_ANYCOLOR);
 
-    df.status = 0;
-    *retdf = &df;
+    ctx->df.status = 0;
+    *retdf = &ctx->df;
 
     if (org_img == NULL) {
         fprintf(stderr, "image file \"%s\": cannot be found.\n", fname);
-        df.status = -1;
+        ctx->df.status = -1;
         return;
     }
 
-    ret = extract_feature(org_img, retdf);
+    ret = extract_feature_r(ctx, org_img, retdf);
+    cvReleaseImage(&org_img);
     if (ret) {
-        df.status = -1;
+        ctx->df.status = -1;
         return;
     }
 
@@ -562,33 +667,46 @@ extract_feature_wrapper(char* fname, datafolder** retdf)
 }
 
 int
-extract_feature(IplImage* org_img, datafolder** retdf)
+extract_feature_r(feature_ctx* ctx, IplImage* org_img, datafolder** retdf)
 {
-    IplConvKernel* element;
-    int            custom_shape[MASKSIZE * MASKSIZE];
-    int            i, j, cc, n, m, d;
-    LabelingBS     labeling;
-    short          contnum;
-    char*          ppp;
-    int            count_pix;
-
-    df.status = 0;
-    *retdf = &df;
+    int        custom_shape[MASKSIZE * MASKSIZE];
+    int        i, j, cc, n, m, d;
+    LabelingBS labeling;
+    short      contnum;
+    char*      ppp;
+    int        count_pix;
+    CvSize     size = cvGetSize(org_img);
+    IplImage*  scaled = NULL;
+
+    ctx->df.status = 0;
+    *retdf = &ctx->df;
+
+    // 大きすぎる入力は最初に縮小し、以降はそれを入力とする
+    // (以降は0の画素だけを文字とするので、半分以上が黒の画素を0にする)
+    if (downscale_size(org_img->width,
+                       org_img->height,
+                       &size.width,
+                       &size.height)) {
+        scaled = pool_image(&ctx->pool,
+                            size,
+                            org_img->depth,
+                            org_img->nChannels);
+        cvResize(org_img, scaled, CV_INTER_AREA);
+        cvThreshold(scaled, scaled, 127, 255, CV_THRESH_BINARY);
+        org_img = scaled;
+    }
 
     // 処理後画像データの確保
-    IplImage* dst_img = cvCreateImage(cvGetSize(org_img), IPL_DEPTH_8U, 1);
-    IplImage* dst_img_dilate =
-        cvCreateImage(cvGetSize(org_img), IPL_DEPTH_8U, 1);
-    IplImage* dst_img_cc = cvCreateImage(cvGetSize(org_img), IPL_DEPTH_8U, 1);
+    IplImage* dst_img = org_img;
+    IplImage* dst_img_dilate = pool_image(&ctx->pool, size, IPL_DEPTH_8U, 1);
+    IplImage* dst_img_cc = pool_image(&ctx->pool, size, IPL_DEPTH_8U, 1);
 #if LATTE_CODE
-    IplImage* dst_img_erode =
-        cvCreateImage(cvGetSize(org_img), IPL_DEPTH_8U, 1);
+    IplImage* dst_img_erode = pool_image(&ctx->pool, size, IPL_DEPTH_8U, 1);
 #endif
 
     if (org_img->nChannels > 1) {
+        dst_img = pool_image(&ctx->pool, size, IPL_DEPTH_8U, 1);
         cvCvtColor(org_img, dst_img, CV_BGR2GRAY);
-    } else {
-        dst_img = org_img;
     }
 
 #ifdef PERIFERAL
@@ -618,21 +736,24 @@ extract_feature(IplImage* org_img, datafolder** retdf)
     // 罫線除去処理
     //=====================================================
     // ラベリング前の膨張処理
-    // 構造要素決定
-    memset(custom_shape, 0, sizeof(int) * MASKSIZE * MASKSIZE);
-    for (i = 0; i < MASKSIZE; i++) {
-        for (j = 0; j < MASKSIZE; j++) {
-            custom_shape[j * MASKSIZE + i] = 1;
+    // 構造要素決定 (ctxごとに1度だけ作る)
+    if (ctx->element == NULL) {
+        memset(custom_shape, 0, sizeof(int) * MASKSIZE * MASKSIZE);
+        for (i = 0; i < MASKSIZE; i++) {
+            for (j = 0; j < MASKSIZE; j++) {
+                custom_shape[j * MASKSIZE + i] = 1;
+            }
         }
+        ctx->element = cvCreateStructuringElementEx(MASKSIZE,
+                                                    MASKSIZE,
+                                                    MASKSIZE / 2,
+                                                    MASKSIZE / 2,
+                                                    CV_SHAPE_CUSTOM,
+                                                    custom_shape);
     }
+    IplConvKernel* element = ctx->element;
 
     // ノイズ除去
-    element = cvCreateStructuringElementEx(MASKSIZE,
-                                           MASKSIZE,
-                                           MASKSIZE / 2,
-                                           MASKSIZE / 2,
-                                           CV_SHAPE_CUSTOM,
-                                           custom_shape);
 #if LATTE_CODE
     cvErode(dst_img, dst_img_erode, element, 1);
     cvErode(dst_img_erode, dst_img_erode, element, 1);
@@ -643,25 +764,24 @@ extract_feature(IplImage* org_img, datafolder** retdf)
     cvErode(dst_img, dst_img_dilate, element, 1);
 #endif
 
-    // ラベリング処理用の配列に膨張後の画像をコピー
-    unsigned char* src = new unsigned char[dst_img->height * dst_img->width];
-    for (i = 0; i < dst_img->width; i++) {
-        for (j = 0; j < dst_img->height; j++) {
-            // labeling.hでは「0」以外を領域とするので、色の反転を
-            if (dst_img_dilate->imageData[j * dst_img->widthStep + i] == 0) {
-                src[j * dst_img->width + i] = 255;
-            } else {
-                src[j * dst_img->width + i] = 0;
-            }
-        }
-    }
+    // labeling.hでは「0」以外を領域とするので、膨張後の画像をその場で
+    // 反転 (0なら255、それ以外は0) する (以降は大きさしか使わない)
+    cvCmpS(dst_img_dilate, 0, dst_img_dilate, CV_CMP_EQ);
 
     // ラべリング実行　(Labeling.h)
-    short* cc_result = new short[dst_img->height * dst_img->width];
+    short* cc_result = (short*)pool_get(
+        &ctx->pool, dst_img->height * dst_img->width * sizeof(short));
 
+    // 画像を行の間隔 (widthStep) ごとそのまま渡す
     // true: 領域の大きな順にソートする,しないならfalse
     // 最後の「3」:領域検出の最小領域）
-    labeling.Exec(src, cc_result, dst_img->width, dst_img->height, true, 3);
+    labeling.Exec((unsigned char*)dst_img_dilate->imageData,
+                  dst_img_dilate->widthStep,
+                  cc_result,
+                  dst_img->width,
+                  dst_img->height,
+                  true,
+                  3);
 
     RegionInfoBS* ri;
     int           num_of_cc = labeling.GetNumOfResultRegions();
@@ -669,7 +789,17 @@ extract_feature(IplImage* org_img, datafolder** retdf)
     double        aspect_ratio;
 
     if (!num_of_cc) {
-        df.status = -1;
+        ctx->df.status = -1;
+        pool_put(&ctx->pool, cc_result);
+        if (dst_img != org_img) {
+            pool_put_image(&ctx->pool, &dst_img);
+        }
+        pool_put_image(&ctx->pool, &dst_img_dilate);
+        pool_put_image(&ctx->pool, &dst_img_cc);
+#ifdef LATTE_CODE
+        pool_put_image(&ctx->pool, &dst_img_erode);
+#endif
+        pool_put_image(&ctx->pool, &scaled);
         return -1;
     }
 
@@ -768,30 +898,32 @@ extract_feature(IplImage* org_img, datafolder** retdf)
             }
         }
     }
+    pool_put(&ctx->pool, cc_result);
 
-    IplImage* cropped = cvCreateImage(
+    IplImage* cropped = pool_image(
+        &ctx->pool,
         cvSize(ABS(top_x - bottom_x) + 1, ABS(top_y - bottom_y) + 1),
         dst_img_cc->depth,
         dst_img_cc->nChannels);
 
     // 本当は太らす前の dst_img なはずだが，dst_imgはノイズが多く，
     // 太らした方が安定しているので dst_img_ccを利用
-    cvSetImageROI(dst_img_cc,
-                  cvRect(bottom_x,
-                         bottom_y,
-                         ABS(top_x - bottom_x) + 1,
-                         ABS(top_y - bottom_y) + 1));
 
-    // 文字部外接矩形の切り出し
-    cvCopy(dst_img_cc, cropped);
-    cvResetImageROI(dst_img_cc);
+    // 文字部外接矩形の切り出し (ROIを設定するとメモリを確保するので直接)
+    for (j = 0; j < cropped->height; j++) {
+        memcpy(cropped->imageData + cropped->widthStep * j,
+               dst_img_cc->imageData + dst_img_cc->widthStep * (bottom_y + j)
+                   + bottom_x,
+               cropped->width);
+    }
 
     //==============================================================
     // アスペクト比を維持したまま，マージンをつけて正方形画像に
     int maxside = MAX((ABS(top_x - bottom_x) + 1), (ABS(top_y - bottom_y) + 1));
-    IplImage* cropped_margin = cvCreateImage(cvSize(maxside, maxside),
-                                             dst_img_cc->depth,
-                                             dst_img_cc->nChannels);
+    IplImage* cropped_margin = pool_image(&ctx->pool,
+                                          cvSize(maxside, maxside),
+                                          dst_img_cc->depth,
+                                          dst_img_cc->nChannels);
 
     // 白で初期化
     for (i = 0; i < cropped_margin->width; i++) {
@@ -822,32 +954,26 @@ extract_feature(IplImage* org_img, datafolder** retdf)
     }
 
     // 64x64の大きさに正規化
-    IplImage* normalized =
-        cvCreateImage(cvSize(64, 64), dst_img_cc->depth, dst_img_cc->nChannels);
+    IplImage* normalized = pool_image(&ctx->pool,
+                                      cvSize(64, 64),
+                                      dst_img_cc->depth,
+                                      dst_img_cc->nChannels);
     cvResize(cropped_margin, normalized, CV_INTER_NN);
 
     // 輪郭線抽出
-    // XXX: カッコ悪いが，結果はGlobal変数で受け渡し
-    contnum = Contour_Detect(normalized);
-    Contour_To_Directional_Pattern(contnum);
-    // 結果はCont[],contnumに入っているので、この領域をfreeする
-    for (int i = 0; i < contnum; i++) {
-        if (Cont[i] != NULL) {
-            free(Cont[i]);
-        }
-    }
+    // 結果はctxで受け渡し
+    contnum = Contour_Detect(ctx, normalized);
+    Contour_To_Directional_Pattern(ctx, contnum);
 
     // ボカシ処理
-    // XXX: カッコ悪いが，結果はGlobal変数で受け渡し
-    Blurring();
+    Blurring(ctx);
 
     // 方向ヒストグラムの正準化
-    // XXX: カッコ悪いが，結果はGlobal変数で受け渡し
-    Equalize_Directional_Pattern();
+    Equalize_Directional_Pattern(ctx);
 
-    // 輝度画像についても縮小＆ぼかし
-    Make_Intensity(normalized);
-    Blur_Intensity();
+    // 輝度画像についても縮小
+    // (ぼかした輝度Blur_IはEqualize_Intensityでしか使わないので求めない)
+    Make_Intensity(ctx, normalized);
 
 #ifdef DISPLAY_IMAGES
     IplImage* dir_image = cvCreateImage(cvSize(4 * N, N),
@@ -866,28 +992,44 @@ extract_feature(IplImage* org_img, datafolder** retdf)
     for (i = 0; i < N; i++) {
         for (j = 0; j < N; j++) {
             dir_image->imageData[dir_image->widthStep * j + i] =
-                (char)(DirPat[0][i][j] * 50 > 255 ? 255 : DirPat[0][i][j] * 50);
+                (char)(ctx->DirPat[i][j][0] * 50 > 255
+                           ? 255
+                           : ctx->DirPat[i][j][0] * 50);
 
             dir_image->imageData[dir_image->widthStep * j + i + N] =
-                (char)(DirPat[1][i][j] * 50 > 255 ? 255 : DirPat[1][i][j] * 50);
+                (char)(ctx->DirPat[i][j][1] * 50 > 255
+                           ? 255
+                           : ctx->DirPat[i][j][1] * 50);
 
             dir_image->imageData[dir_image->widthStep * j + i + 2 * N] =
-                (char)(DirPat[2][i][j] * 50 > 255 ? 255 : DirPat[2][i][j] * 50);
+                (char)(ctx->DirPat[i][j][2] * 50 > 255
+                           ? 255
+                           : ctx->DirPat[i][j][2] * 50);
 
             dir_image->imageData[dir_image->widthStep * j + i + 3 * N] =
-                (char)(DirPat[3][i][j] * 50 > 255 ? 255 : DirPat[3][i][j] * 50);
+                (char)(ctx->DirPat[i][j][3] * 50 > 255
+                           ? 255
+                           : ctx->DirPat[i][j][3] * 50);
 
             bdir_image->imageData[bdir_image->widthStep * j + i] =
-                (char)(Blur[0][i][j] * 10 > 255 ? 255 : Blur[0][i][j] * 10);
+                (char)(ctx->Blur[i][j][0] * 10 > 255
+                           ? 255
+                           : ctx->Blur[i][j][0] * 10);
 
             bdir_image->imageData[bdir_image->widthStep * j + i + N] =
-                (char)(Blur[1][i][j] * 10 > 255 ? 255 : Blur[1][i][j] * 10);
+                (char)(ctx->Blur[i][j][1] * 10 > 255
+                           ? 255
+                           : ctx->Blur[i][j][1] * 10);
 
             bdir_image->imageData[bdir_image->widthStep * j + i + 2 * N] =
-                (char)(Blur[2][i][j] * 10 > 255 ? 255 : Blur[2][i][j] * 10);
+                (char)(ctx->Blur[i][j][2] * 10 > 255
+                           ? 255
+                           : ctx->Blur[i][j][2] * 10);
 
             bdir_image->imageData[bdir_image->widthStep * j + i + 3 * N] =
-                (char)(Blur[3][i][j] * 10 > 255 ? 255 : Blur[3][i][j] * 10);
+                (char)(ctx->Blur[i][j][3] * 10 > 255
+                           ? 255
+                           : ctx->Blur[i][j][3] * 10);
 
             /*
             final_image->imageData[final_image->widthStep * j + i] =
@@ -907,7 +1049,7 @@ extract_feature(IplImage* org_img, datafolder** retdf)
     for (i = 0; i < 64; i++)
         for (j = 0; j < 64; j++)
             contour_image->imageData[contour_image->widthStep * j + i] =
-                (char)(ContImg[i][j] > 0 ? 255 : 0);
+                (char)(ctx->ContImg[i][j] > 0 ? 255 : 0);
 
     //画像の表示
     cvNamedWindow("org_img");
@@ -943,36 +1085,413 @@ extract_feature(IplImage* org_img, datafolder** retdf)
     cvReleaseImage(&contour_image);
 #endif
 
-    //画像データの解放
-    cvReleaseImage(&cropped);
-    cvReleaseImage(&cropped_margin);
-    cvReleaseImage(&normalized);
-    if (dst_img == org_img) {
-        // a dirty hack for mono
-        cvReleaseImage(&org_img);
-    } else {
-        cvReleaseImage(&org_img);
-        cvReleaseImage(&dst_img);
+    //画像データをプールに返す (元のorg_imgは呼出し側で解放する)
+    pool_put_image(&ctx->pool, &cropped);
+    pool_put_image(&ctx->pool, &cropped_margin);
+    pool_put_image(&ctx->pool, &normalized);
+    if (dst_img != org_img) {
+        pool_put_image(&ctx->pool, &dst_img);
     }
-    cvReleaseImage(&dst_img_dilate);
-    cvReleaseImage(&dst_img_cc);
+    pool_put_image(&ctx->pool, &dst_img_dilate);
+    pool_put_image(&ctx->pool, &dst_img_cc);
 #ifdef LATTE_CODE
-    cvReleaseImage(&dst_img_erode);
+    pool_put_image(&ctx->pool, &dst_img_erode);
 #endif
+    pool_put_image(&ctx->pool, &scaled);
 
     return 0;
 }
 
+/*===================================================================*
+ * ピボットの選択 (farthest-first traversal)
+ *
+ * 最初のエントリから始め、既に選んだピボットのいずれからも最も遠い
+ * エントリを次のピボットとする。pdistには全エントリから各ピボット
+ * への距離を格納する。
+ *===================================================================*/
+static int
+select_pivots(DIRP (*feature_data)[N][N],
+              int       nitems,
+              dist_func dist,
+              int*      pivots,
+              double*   pdist)
+{
+    int     n, p, npivots, farthest;
+    double* nearest;
+
+    npivots = MIN(NPIVOTS, nitems);
+    nearest = (double*)malloc(sizeof(double) * nitems);
+    for (n = 0; n < nitems; n++) {
+        nearest[n] = 1e10;
+    }
+
+    farthest = 0;
+    for (p = 0; p < npivots; p++) {
+        pivots[p] = farthest;
+        for (n = 0; n < nitems; n++) {
+            pdist[n * npivots + p] =
+                dist(&feature_data[n], &feature_data[pivots[p]]);
+            nearest[n] = MIN(nearest[n], pdist[n * npivots + p]);
+        }
+        // 選んだピボットは負にして、次の候補から外す
+        nearest[pivots[p]] = -1;
+
+        // 全エントリの更新が済んでから最も遠いエントリを選ぶ
+        farthest = 0;
+        for (n = 1; n < nitems; n++) {
+            if (nearest[n] > nearest[farthest]) {
+                farthest = n;
+            }
+        }
+    }
+
+    free(nearest);
+
+    return npivots;
+}
+
+/*===================================================================*
+ * データベースのパッキング
+ *
+ *   feature_db | 特徴量 | クラス | 順番 | 低解像度特徴 |
+ *   クラス情報 | 重心 | ピボット | ピボット距離 | メタデータ
+ *
+ * エントリはクラス順に並べ替える (同じクラス内では画像リストの順)。
+ * channelsは距離計算に用いる方向特徴の数 (旧形式から変換する場合は4)。
+ * deskewは特徴抽出に用いた傾き補正の方法 (DESKEW_*)。
+ * metaは作成元などを記録する文字列 (NULL可)。
+ *===================================================================*/
+feature_db*
+db_pack(DIRP (*feature_data)[N][N],
+        char*       class_data,
+        int         nitems,
+        int         channels,
+        int         deskew,
+        const char* meta)
+{
+    feature_db* db;
+    DIRP(*sorted_data)
+    [N][N];
+    DIRP(*centroid_data)
+    [N][N];
+    char*       sorted_class;
+    int*        order;
+    DIRP_S*     summary_data;
+    class_info* cinfo;
+    dist_func   dist_f;
+    int         count[256], start[256];
+    int         i, j, d, c, m, n, nclasses, npivots;
+    int         feature_offset, class_offset, order_offset, summary_offset;
+    int         cinfo_offset, centroid_offset, pivot_offset, pdist_offset;
+    int         meta_offset, length;
+    double      dist;
+
+    if (meta == NULL) {
+        meta = "";
+    }
+
+    // クラスごとのエントリ数
+    memset(count, 0, sizeof(count));
+    for (n = 0; n < nitems; n++) {
+        count[(unsigned char)class_data[n]]++;
+    }
+    nclasses = 0;
+    for (c = 0, m = 0; c < 256; c++) {
+        start[c] = m;
+        m += count[c];
+        if (count[c]) {
+            nclasses++;
+        }
+    }
+    npivots = MIN(NPIVOTS, nitems);
+
+    feature_offset = DB_ALIGN(sizeof(feature_db));
+    class_offset = feature_offset + sizeof(DIRP[N][N]) * nitems;
+    order_offset = DB_ALIGN(class_offset + sizeof(char) * nitems);
+    summary_offset = order_offset + sizeof(int) * nitems;
+    cinfo_offset = DB_ALIGN(summary_offset + sizeof(DIRP_S) * nitems);
+    centroid_offset = cinfo_offset + sizeof(class_info) * nclasses;
+    pivot_offset = DB_ALIGN(centroid_offset + sizeof(DIRP[N][N]) * nclasses);
+    pdist_offset = DB_ALIGN(pivot_offset + sizeof(int) * npivots);
+    meta_offset = pdist_offset + sizeof(double) * npivots * nitems;
+    length = DB_ALIGN(meta_offset + strlen(meta) + 1);
+
+    db = (feature_db*)calloc(1, length);
+    if (db == NULL) {
+        return NULL;
+    }
+    db->magic = MAGIC_NO;
+    db->nitems = nitems;
+    db->feature_offset = feature_offset;
+    db->class_offset = class_offset;
+    db->order_offset = order_offset;
+    db->summary_offset = summary_offset;
+    db->nclasses = nclasses;
+    db->cinfo_offset = cinfo_offset;
+    db->centroid_offset = centroid_offset;
+    db->npivots = npivots;
+    db->pivot_offset = pivot_offset;
+    db->pdist_offset = pdist_offset;
+    db->knn = 1;
+    db->version = DB_VERSION;
+    db->byte_order = DB_BYTE_ORDER;
+    db->header_size = sizeof(feature_db);
+    db->n = N;
+    db->channels = channels;
+    db->elem_size = sizeof(DIRP);
+    db->dtype = DB_DTYPE_U8;
+    db->align = DB_ALIGN(1);
+#ifdef THINNING
+    db->thinning = TRUE;
+#else
+    db->thinning = FALSE;
+#endif
+    db->deskew = deskew;
+    db->meta_offset = meta_offset;
+    db->length = length;
+    strcpy((char*)db + meta_offset, meta);
+
+    sorted_data = (DIRP(*)[N][N])((char*)db + feature_offset);
+    sorted_class = (char*)db + class_offset;
+    order = (int*)((char*)db + order_offset);
+    summary_data = (DIRP_S*)((char*)db + summary_offset);
+    cinfo = (class_info*)((char*)db + cinfo_offset);
+    centroid_data = (DIRP(*)[N][N])((char*)db + centroid_offset);
+    dist_f = db_dist(db);
+
+    // クラス順に並べ替え
+    for (n = 0; n < nitems; n++) {
+        m = start[(unsigned char)class_data[n]]++;
+        order[m] = n;
+        sorted_class[m] = class_data[n];
+        memcpy(&sorted_data[m], &feature_data[n], sizeof(DIRP[N][N]));
+        DIRP_Summarize(&sorted_data[m], &summary_data[m]);
+    }
+
+    // クラスごとの重心・半径・分散 (平均は丸めずに用いる)
+    for (c = 0, m = 0, nclasses = 0; c < 256; c++) {
+        if (!count[c]) {
+            continue;
+        }
+        class_info* ci = &cinfo[nclasses];
+        DIRP(*G)
+        [N][N] = &centroid_data[nclasses];
+
+        ci->label = c;
+        ci->start = m;
+        ci->count = count[c];
+        ci->radius = 0;
+        ci->variance = 0;
+
+        for (i = 0; i < N; i++) {
+            for (j = 0; j < N; j++) {
+                long sum_I = 0, sum_d[CHANNELS], sum2_d[CHANNELS];
+
+                memset(sum_d, 0, sizeof(sum_d));
+                memset(sum2_d, 0, sizeof(sum2_d));
+                for (n = m; n < m + count[c]; n++) {
+                    sum_I += sorted_data[n][i][j].I;
+                    for (d = 0; d < channels; d++) {
+                        int v = sorted_data[n][i][j].d[d];
+
+                        sum_d[d] += v;
+                        sum2_d[d] += v * v;
+                    }
+                }
+                G[0][i][j].I = (sum_I + count[c] / 2) / count[c];
+                for (d = 0; d < channels; d++) {
+                    double mu = (double)sum_d[d] / count[c];
+
+                    G[0][i][j].d[d] = (sum_d[d] + count[c] / 2) / count[c];
+                    ci->variance += (double)sum2_d[d] / count[c] - mu * mu;
+                }
+            }
+        }
+        for (n = m; n < m + count[c]; n++) {
+            dist = dist_f(G, &sorted_data[n]);
+            ci->radius = MAX(ci->radius, dist);
+        }
+
+        m += count[c];
+        nclasses++;
+    }
+
+    select_pivots(sorted_data,
+                  nitems,
+                  dist_f,
+                  (int*)((char*)db + pivot_offset),
+                  (double*)((char*)db + pdist_offset));
+
+    return db;
+}
+
+/*===================================================================*
+ * クラス順に並べ替えたエントリを画像リストの順に戻す
+ *===================================================================*/
+static void
+db_unsort(feature_db* db, DIRP (*feature_data)[N][N], char* class_data)
+{
+    DIRP(*sorted_data)
+    [N][N] = (DIRP(*)[N][N])((char*)db + db->feature_offset);
+    char* sorted_class = (char*)db + db->class_offset;
+    int*  order = (int*)((char*)db + db->order_offset);
+    int   m;
+
+    for (m = 0; m < db->nitems; m++) {
+        memcpy(&feature_data[order[m]], &sorted_data[m], sizeof(DIRP[N][N]));
+        class_data[order[m]] = sorted_class[m];
+    }
+}
+
+/*===================================================================*
+ * データベースの結合
+ *
+ * 特徴量を再抽出せず、aのエントリの後にbのエントリを画像リストの順に
+ * 並べて再パッキングする。kはaのものを引き継ぐ。傾き補正の方法が
+ * 異なるものは結合しない。
+ *===================================================================*/
+feature_db*
+db_merge(feature_db* a, feature_db* b)
+{
+    feature_db* dbs[2] = { a, b };
+    feature_db* db;
+    DIRP(*feature_data)
+    [N][N];
+    char* class_data;
+    char* meta;
+    int   i, base, nitems;
+
+    if (a->channels != b->channels) {
+        fprintf(stderr,
+                "cannot merge databases with different channels (%d, %d)\n",
+                a->channels,
+                b->channels);
+        return NULL;
+    }
+    if (a->deskew != b->deskew) {
+        fprintf(stderr,
+                "cannot merge databases with different deskew (%s, %s)\n",
+                db_deskew_name(a->deskew),
+                db_deskew_name(b->deskew));
+        return NULL;
+    }
+
+    nitems = a->nitems + b->nitems;
+    feature_data = (DIRP(*)[N][N])malloc(sizeof(DIRP[N][N]) * nitems);
+    class_data = (char*)malloc(sizeof(char) * nitems);
+    meta = (char*)malloc(strlen(db_meta(a)) + strlen(db_meta(b)) + 4);
+
+    // 画像リストの順に戻して連結
+    for (i = 0, base = 0; i < 2; i++) {
+        db_unsort(dbs[i], &feature_data[base], &class_data[base]);
+        base += dbs[i]->nitems;
+    }
+    sprintf(meta, "%s + %s", db_meta(a), db_meta(b));
+
+    db = db_pack(
+        feature_data, class_data, nitems, a->channels, a->deskew, meta);
+    if (db) {
+        db->knn = a->knn;
+    }
+
+    free(feature_data);
+    free(class_data);
+    free(meta);
+
+    return db;
+}
+
+/*===================================================================*
+ * データベースに合った距離関数
+ *
+ * 細線化版で作成したデータベースは全ての方向の特徴を用いる。
+ *===================================================================*/
+dist_func
+db_dist(feature_db* db)
+{
+    if (db->channels > 4) {
+        return DIRP_Dist_All;
+    }
+    return DIRP_Dist;
+}
+
+const char*
+db_meta(feature_db* db)
+{
+    return (char*)db + db->meta_offset;
+}
+
+/*
+ * 傾き補正の方法 (DESKEW_*) の名前 (KOCR_DESKEWやthinの--deskewと同じ)
+ */
+const char*
+db_deskew_name(int deskew)
+{
+    switch (deskew) {
+    case DESKEW_NONE:
+        return "none";
+    case DESKEW_ROTATE:
+        return "rotate";
+    case DESKEW_SHEAR:
+        return "shear";
+    }
+    return "unknown";
+}
+
+int
+db_length(feature_db* db)
+{
+    return db->length;
+}
+
+/*===================================================================*
+ * データベースのチェックサム (checksumを0として計算したFNV-1a)
+ *===================================================================*/
+static unsigned int
+db_checksum(feature_db* db, int len)
+{
+    unsigned char* p = (unsigned char*)db;
+    unsigned int   saved = db->checksum;
+    unsigned int   h = 2166136261u;
+    int            n;
+
+    db->checksum = 0;
+    for (n = 0; n < len; n++) {
+        h = (h ^ p[n]) * 16777619u;
+    }
+    db->checksum = saved;
+
+    return h;
+}
+
+/*===================================================================*
+ * 特徴量のハッシュ (FNV-1a、距離のキャッシュの識別に用いる)
+ *===================================================================*/
+unsigned int
+db_hash(feature_db* db)
+{
+    unsigned char* p = (unsigned char*)db + db->feature_offset;
+    unsigned int   h = 2166136261u;
+    long           n, len = (long)sizeof(DIRP[N][N]) * db->nitems;
+
+    h = (h ^ (unsigned int)db->channels) * 16777619u;
+    for (n = 0; n < len; n++) {
+        h = (h ^ p[n]) * 16777619u;
+    }
+
+    return h;
+}
+
 int
 db_save(char* fname, feature_db* db)
 {
     int fd, w, len;
 
-    if ((fd = open(fname, O_WRONLY | O_CREAT, 0644)) < 0) {
+    if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
         return -1;
     }
-    len = sizeof(feature_db) + sizeof(DIRP[N][N]) * db->nitems
-        + sizeof(char) * db->nitems;
+    len = db_length(db);
+    db->checksum = db_checksum(db, len);
 
     char* current = (char*)db;
     while ((w = write(fd, current, len)) > 0) {
@@ -990,6 +1509,132 @@ db_save(char* fname, feature_db* db)
     return 0;
 }
 
+/*===================================================================*
+ * 旧形式 (ヘッダに特徴の形状が無いもの) のデータベースの変換
+ *
+ * 旧形式は方向特徴を4つだけ格納しているので、channelsは4とする。
+ * 特徴量の大きさがこのビルドと合わないものは読み込まない。
+ *===================================================================*/
+static feature_db*
+db_upgrade(feature_db* old, int len)
+{
+    if (old->nitems <= 0 || old->feature_offset <= 0
+        || old->class_offset
+               != old->feature_offset + (int)sizeof(DIRP[N][N]) * old->nitems
+        || old->class_offset + old->nitems > len) {
+        fprintf(stderr,
+                "database was built with a different configuration "
+                "(expected N=%d, %d bytes per pixel)\n",
+                N,
+                (int)sizeof(DIRP));
+        return NULL;
+    }
+
+    return db_pack((DIRP(*)[N][N])((char*)old + old->feature_offset),
+                   (char*)old + old->class_offset,
+                   old->nitems,
+                   4,
+                   DESKEW_DEFAULT,
+                   "converted from v1");
+}
+
+/*===================================================================*
+ * 版2, 3のデータベースの変換
+ *
+ * 版2のクラス情報には分散が、版3までのヘッダには傾き補正の方法が無い
+ * ので、特徴量からパッキングし直す。傾き補正は当時唯一だった
+ * DESKEW_DEFAULTとする。
+ *===================================================================*/
+static feature_db*
+db_upgrade_v2(feature_db* old)
+{
+    feature_db* db;
+    DIRP(*feature_data)
+    [N][N];
+    char* class_data;
+
+    feature_data = (DIRP(*)[N][N])malloc(sizeof(DIRP[N][N]) * old->nitems);
+    class_data = (char*)malloc(sizeof(char) * old->nitems);
+    if (feature_data == NULL || class_data == NULL) {
+        free(feature_data);
+        free(class_data);
+        return NULL;
+    }
+    db_unsort(old, feature_data, class_data);
+
+    db = db_pack(feature_data,
+                 class_data,
+                 old->nitems,
+                 old->channels,
+                 DESKEW_DEFAULT,
+                 db_meta(old));
+    if (db) {
+        db->knn = old->knn;
+    }
+
+    free(feature_data);
+    free(class_data);
+
+    return db;
+}
+
+/*===================================================================*
+ * 版2までのデータベースの特徴量は、ぼかしの実装 (blur.h) を変える前に
+ * 抽出したものであることが多く、その場合は変換しても同じ画像から
+ * このビルドで抽出した特徴量と一致しない。読み込みは続けるが、画像
+ * リストからの作り直しを促す。
+ *===================================================================*/
+static void
+db_warn_stale(const char* fname)
+{
+    fprintf(stderr,
+            "warning: %s was built by an older version and its features "
+            "may not match this build; regenerate it from the image list\n",
+            fname);
+}
+
+/*===================================================================*
+ * ヘッダに記録された特徴の形状がこのビルドと合うか調べる
+ *===================================================================*/
+static int
+db_check(feature_db* db, int len)
+{
+    if (db->byte_order != DB_BYTE_ORDER) {
+        fprintf(stderr, "database has a different byte order\n");
+        return FALSE;
+    }
+    if (db->version < 2 || db->version > DB_VERSION
+        || db->header_size
+               != (db->version < 4 ? (int)offsetof(feature_db, deskew)
+                                   : (int)sizeof(feature_db))) {
+        fprintf(stderr, "unsupported database version: %d\n", db->version);
+        return FALSE;
+    }
+    if (db->n != N || db->elem_size != sizeof(DIRP) || db->dtype != DB_DTYPE_U8
+        || db->channels < 1 || db->channels > CHANNELS) {
+        fprintf(stderr,
+                "database was built with a different configuration "
+                "(N=%d, %d channels%s)\n",
+                db->n,
+                db->channels,
+                db->thinning ? ", thinning" : "");
+        return FALSE;
+    }
+    // 版3までのヘッダにはdeskewが無い (db_upgrade_v2で補う)
+    if (db->version >= 4
+        && (db->thinning ? db->deskew < DESKEW_NONE || db->deskew > DESKEW_SHEAR
+                         : db->deskew != DESKEW_NONE)) {
+        fprintf(stderr, "database has an unknown deskew: %d\n", db->deskew);
+        return FALSE;
+    }
+    if (db->length != len || db->checksum != db_checksum(db, len)) {
+        fprintf(stderr, "database is broken (length or checksum mismatch)\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 feature_db*
 db_load(char* fname)
 {
@@ -1008,17 +1653,39 @@ db_load(char* fname)
         return NULL;
     }
     len = sb.st_size;
-    db = (feature_db*)malloc(len);
+    db = (feature_db*)calloc(1, MAX(len, (int)sizeof(feature_db)));
     char* current = (char*)db;
     while ((r = read(fd, current, len)) > 0) {
         current += r;
         len -= r;
     }
-    if (r < 0) {
+    close(fd);
+    if (r < 0 || db->magic != (int)MAGIC_NO) {
+        fprintf(stderr, "not a database file: %s\n", fname);
+        free(db);
         return NULL;
     }
+    len = sb.st_size;
 
-    close(fd);
+    if (db->feature_offset < (int)sizeof(feature_db)) {
+        // 旧形式のデータベースには補助情報が無いので、ここで生成する
+        feature_db* old = db;
+
+        db_warn_stale(fname);
+        db = db_upgrade(old, len);
+        free(old);
+    } else if (!db_check(db, len)) {
+        free(db);
+        db = NULL;
+    } else if (db->version < DB_VERSION) {
+        feature_db* old = db;
+
+        if (db->version < 3) {
+            db_warn_stale(fname);
+        }
+        db = db_upgrade_v2(old);
+        free(old);
+    }
 
     /* XXX: この関数でmallocした領域をは呼び出し元でfreeすること */
     return db;
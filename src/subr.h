@@ -29,19 +29,60 @@
 #ifndef SUBR_H
 #define SUBR_H
 
+#include "pool.h"
+
+/*
+ * 特徴抽出の作業領域 (スレッドごとに用意すれば並行に特徴抽出できる)
+ *
+ * 0で初期化して使い始め、使い終えたらfeature_ctx_finishで解放する。
+ */
+typedef struct {
+    unsigned char ContImg[64][64];
+    int           DirPat[N][N][4];
+    double        Blur[N][N][4];
+    short         ContLen[MAXCONTOUR];
+    double        Blur_I[N][N];
+    Contour*      Cont[MAXCONTOUR];
+    int           ContCap[MAXCONTOUR]; // Cont[]の確保済みの要素数
+    datafolder    df;                  // 抽出結果
+
+    scratch_pool   pool;    // 画像などの作業領域
+    IplConvKernel* element; // ノイズ除去の構造要素
+
+    unsigned long long rkey[4 * N * N];      // 平坦化で順位付けするキー
+    unsigned short     rorder[2][4 * N * N]; // 順位付けの作業領域
+} feature_ctx;
+
 /* prototypes */
-short  Contour_Detect(IplImage*);
-void   Contour_To_Directional_Pattern(short);
-void   Blurring();
-void   Equalize_Intensity();
-void   Equalize_Directional_Pattern();
-int    Compare(const void*, const void*);
-void   Make_Intensity(IplImage*);
-void   Blur_Intensity();
+short  Contour_Detect(feature_ctx*, IplImage*);
+void   Contour_To_Directional_Pattern(feature_ctx*, short);
+void   Blurring(feature_ctx*);
+void   Equalize_Intensity(feature_ctx*);
+void   Equalize_Directional_Pattern(feature_ctx*);
+void   Make_Intensity(feature_ctx*, IplImage*);
+void   Blur_Intensity(feature_ctx*);
 double DIRP_Dist(DIRP (*)[N][N], DIRP (*)[N][N]);
+double DIRP_Dist_All(DIRP (*)[N][N], DIRP (*)[N][N]);
+void   DIRP_Summarize(DIRP (*)[N][N], DIRP_S*);
+double DIRP_Bound(DIRP_S*, DIRP_S*);
 int    extract_feature(IplImage*, datafolder**);
 void   extract_feature_wrapper(char*, datafolder**);
+int    extract_feature_r(feature_ctx*, IplImage*, datafolder**);
+void   extract_feature_wrapper_r(feature_ctx*, char*, datafolder**);
 int    db_save(char*, feature_db*);
+int    db_length(feature_db*);
+
+feature_ctx* feature_ctx_thread();
+void         feature_ctx_finish(feature_ctx*);
+
+typedef double (*dist_func)(DIRP (*)[N][N], DIRP (*)[N][N]);
+
+feature_db*  db_pack(DIRP (*)[N][N], char*, int, int, int, const char*);
+feature_db*  db_merge(feature_db*, feature_db*);
+dist_func    db_dist(feature_db*);
+const char*  db_meta(feature_db*);
+const char*  db_deskew_name(int);
+unsigned int db_hash(feature_db*);
 
 #ifdef __cplusplus
 #define _EX_DECL
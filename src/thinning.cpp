@@ -35,6 +35,9 @@
 
 #include "Labeling.h"
 #include "kocr.h"
+#include "blur.h"
+#include "pool.h"
+#include "downscale.h"
 
 #ifndef KOCR_H
 // defined in kocr.h
@@ -63,86 +66,191 @@ static int   checkPreprocessedImage(const cv::Mat& img_src,
                                     const cv::Mat& img_extracted,
                                     const cv::Mat& img_normalized);
 static int   showPreprocessedImageFlag = 0;
+static int   showStatsFlag = 0;
+static int   deskewMode = DESKEW_ROTATE;
 static char* writePreprocessedImageFileName = NULL;
 #endif /* THINNING_MAIN */
 
 // 膨張・収縮処理用マスク
 static cv::Mat element = (cv::Mat_<uchar>(3, 3) << 0, 1, 0, 1, 1, 1, 0, 1, 0);
 
-/* 分散σ^2=4のガウス分布(正規化項は無し) */
-static double Gauss[][5] = {
-    {1.0000, 0.8825, 0.6065, 0.3247, 0.1353},
-    {0.8825, 0.7788, 0.5353, 0.2865, 0.1194},
-    {0.6065, 0.5353, 0.3679, 0.1969, 0.0821},
-    {0.3247, 0.2865, 0.1969, 0.1054, 0.0439},
-    {0.1353, 0.1194, 0.0821, 0.0439, 0.0183}
+// ラベリングの作業領域 (呼出しをまたいで使い回す)
+static scratch_pool work;
+
+// Extract_Featureの段階 (バックトラックではSTAGE_MORPHに戻る)
+enum {
+    STAGE_MORPH,  // 膨張・収縮と線の太さの推定
+    STAGE_LABEL,  // ラベリング
+    STAGE_SELECT, // 文字要素の選択とバックトラックの判定
+    STAGE_DONE    // 切り出し以降
 };
 
+// 統計を取る画像処理
+enum { OP_DILATE, OP_ERODE, OP_DISTANCE, OP_LABELING, OPS };
+
+#define STATS_HIST 4 /* 呼出しあたりの判定回数の分布の上限 (以上はまとめる) */
+
+// 段階ごとの統計 (Extract_Feature_statsで出力する)
+static struct {
+    long  calls;                 // Extract_Featureの呼出し回数
+    long  rounds;                // STAGE_MORPHからやり直した回数 (初回を含む)
+    long  hist[STATS_HIST];      // hist[n]: 判定をn+1回行った呼出しの数
+    long  ops[OPS];              // 画像処理ごとの実行回数
+    int64 ticks[STAGE_DONE + 1]; // 段階ごとの時間
+} stats;
+
 /**
  * Code for thinning a binary image using Zhang-Suen algorithm.
  *
  * Implemented by Nash, see http://opencv-code.com/quick-tips/
+ *
+ * 1行をTHIN_WORD画素ずつunsigned long longに詰め、8近傍を語のシフトで
+ * 求めて、1語分の画素の削除をビット演算でまとめて判定する。判定条件は
+ * Nashの実装と同じで、結果も一致する。
  */
+#define THIN_WORD 64 /* 1語あたりの画素数 */
+
+typedef unsigned long long thin_word;
+
+/* 語kの各画素の右 (j+1) の画素 */
+#define THIN_EAST(row, k, words)                                               \
+    (((row)[k] >> 1) | ((k) + 1 < (words) ? (row)[(k) + 1] << 63 : 0))
+/* 語kの各画素の左 (j-1) の画素 */
+#define THIN_WEST(row, k) (((row)[k] << 1) | ((k) > 0 ? (row)[(k)-1] >> 63 : 0))
+
 /**
  * Perform one thinning iteration.
- * Normally you wouldn't call this function directly from your code.
  *
- * @param  im    Binary image with range = 0-1
- * @param  iter  0=even, 1=odd
+ * 削除する画素の条件 (p2〜p9は上から時計回りの8近傍)
+ *   A == 1      : p2→p3→…→p9→p2 で0から1に変わる回数が1
+ *   2 <= B <= 6 : 8近傍の1が2個以上、0も2個以上
+ *   m1 == 0, m2 == 0 : iterで決まる3近傍の組がいずれも全て1ではない
+ *
+ * 削除は全画素を判定してから一斉に行うので、更新前の上の行と現在の行を
+ * saveに残しながら上から処理する。
+ *
+ * @param  img    Packed binary image (rows x words)
+ * @param  save   Work area of 2 * words
+ * @param  mask   Pixels to examine in a row (excluding the border)
+ * @param  iter   0=even, 1=odd
+ * @return        Whether any pixel was removed
  */
-void
-thinningIteration(cv::Mat& im, int iter)
+static int
+thinningIteration(thin_word*       img,
+                  thin_word*       save,
+                  const thin_word* mask,
+                  int              rows,
+                  int              words,
+                  int              iter)
 {
-    cv::Mat marker = cv::Mat::zeros(im.size(), CV_8UC1);
-
-    for (int i = 1; i < im.rows - 1; i++) {
-        for (int j = 1; j < im.cols - 1; j++) {
-            uchar p2 = im.at<uchar>(i - 1, j);
-            uchar p3 = im.at<uchar>(i - 1, j + 1);
-            uchar p4 = im.at<uchar>(i, j + 1);
-            uchar p5 = im.at<uchar>(i + 1, j + 1);
-            uchar p6 = im.at<uchar>(i + 1, j);
-            uchar p7 = im.at<uchar>(i + 1, j - 1);
-            uchar p8 = im.at<uchar>(i, j - 1);
-            uchar p9 = im.at<uchar>(i - 1, j - 1);
-
-            int A = (p2 == 0 && p3 == 1) + (p3 == 0 && p4 == 1)
-                  + (p4 == 0 && p5 == 1) + (p5 == 0 && p6 == 1)
-                  + (p6 == 0 && p7 == 1) + (p7 == 0 && p8 == 1)
-                  + (p8 == 0 && p9 == 1) + (p9 == 0 && p2 == 1);
-            int B = p2 + p3 + p4 + p5 + p6 + p7 + p8 + p9;
-            int m1 = iter == 0 ? (p2 * p4 * p6) : (p2 * p4 * p8);
-            int m2 = iter == 0 ? (p4 * p6 * p8) : (p2 * p6 * p8);
-
-            if (A == 1 && (B >= 2 && B <= 6) && m1 == 0 && m2 == 0) {
-                marker.at<uchar>(i, j) = 1;
+    thin_word *above = save, *cur = save + words, *tmp;
+    thin_word  p[8], t, ones, twos, zeros1, zeros2, a, del, changed = 0;
+    int        i, k, n;
+
+    memcpy(above, img, sizeof(thin_word) * words);
+    for (i = 1; i < rows - 1; i++) {
+        thin_word* row = img + i * words;
+        thin_word* below = row + words;
+
+        memcpy(cur, row, sizeof(thin_word) * words);
+        for (k = 0; k < words; k++) {
+            p[0] = above[k];                    // p2
+            p[1] = THIN_EAST(above, k, words);  // p3
+            p[2] = THIN_EAST(cur, k, words);    // p4
+            p[3] = THIN_EAST(below, k, words);  // p5
+            p[4] = below[k];                    // p6
+            p[5] = THIN_WEST(below, k);         // p7
+            p[6] = THIN_WEST(cur, k);           // p8
+            p[7] = THIN_WEST(above, k);         // p9
+
+            // A: 0→1の変化が1回だけのビット
+            ones = twos = 0;
+            for (n = 0; n < 8; n++) {
+                t = ~p[n] & p[(n + 1) % 8];
+                twos |= ones & t;
+                ones |= t;
             }
+            a = ones & ~twos;
+
+            // B: 1が2個以上 (twos) かつ0が2個以上 (zeros2)
+            ones = twos = zeros1 = zeros2 = 0;
+            for (n = 0; n < 8; n++) {
+                twos |= ones & p[n];
+                ones |= p[n];
+                zeros2 |= zeros1 & ~p[n];
+                zeros1 |= ~p[n];
+            }
+
+            del = cur[k] & mask[k] & a & twos & zeros2;
+            if (iter == 0) {
+                del &= ~(p[0] & p[2] & p[4]) & ~(p[2] & p[4] & p[6]);
+            } else {
+                del &= ~(p[0] & p[2] & p[6]) & ~(p[0] & p[4] & p[6]);
+            }
+            row[k] = cur[k] & ~del;
+            changed |= del;
         }
+        tmp = above;
+        above = cur;
+        cur = tmp;
     }
 
-    im &= ~marker;
+    return changed != 0;
 }
 
 /**
  * Function for thinning the given binary image
  *
+ * 各回の2つのiterationでいずれかの画素を削除した間は繰り返す。
+ *
  * @param  im  Binary image with range = 0-255
  */
 void
 thinning(cv::Mat& im)
 {
+    thin_word *img, *save, *mask;
+    int        rows = im.rows, cols = im.cols;
+    int        words = (cols + THIN_WORD - 1) / THIN_WORD;
+    int        i, j, changed;
+
     im /= 255;
 
-    cv::Mat prev = cv::Mat::zeros(im.size(), CV_8UC1);
-    cv::Mat diff;
+    img = (thin_word*)pool_get(&work,
+                               sizeof(thin_word) * (rows + 3) * words);
+    save = img + rows * words;
+    mask = save + 2 * words;
+
+    // 画素を詰める
+    memset(img, 0, sizeof(thin_word) * rows * words);
+    for (i = 0; i < rows; i++) {
+        const uchar* src = im.ptr<uchar>(i);
+        for (j = 0; j < cols; j++) {
+            if (src[j]) {
+                img[i * words + j / THIN_WORD] |= 1ULL << (j % THIN_WORD);
+            }
+        }
+    }
+    // 左右の端の列は判定しない
+    memset(mask, 0, sizeof(thin_word) * words);
+    for (j = 1; j < cols - 1; j++) {
+        mask[j / THIN_WORD] |= 1ULL << (j % THIN_WORD);
+    }
 
     do {
-        thinningIteration(im, 0);
-        thinningIteration(im, 1);
-        cv::absdiff(im, prev, diff);
-        im.copyTo(prev);
-    } while (cv::countNonZero(diff) > 0);
+        changed = thinningIteration(img, save, mask, rows, words, 0);
+        changed |= thinningIteration(img, save, mask, rows, words, 1);
+    } while (changed);
+
+    // 画素を戻す
+    for (i = 0; i < rows; i++) {
+        uchar* dst = im.ptr<uchar>(i);
+        for (j = 0; j < cols; j++) {
+            dst[j] = (img[i * words + j / THIN_WORD] >> (j % THIN_WORD)) & 1;
+        }
+    }
+    pool_put(&work, img);
 
+    cv::Mat prev;
 #if 1
     // 細線化後、再膨張処理 (理由は未調査だが、これで大幅に性能向上)
     cv::dilate(im, prev, element, cv::Point(-1, -1), 1);
@@ -152,7 +260,6 @@ thinning(cv::Mat& im)
 #endif
 
     prev.release();
-    diff.release();
 }
 
 /**
@@ -185,128 +292,158 @@ deskew(cv::Mat& img)
 }
 
 /**
- * Detection of edge angles
+ * Deskew the normalized image by a horizontal shear
+ *
+ * deskewと同じくモーメントから傾き (mu11 / mu02) を求め、重心の行を基準に
+ * 各行を横にずらす (線形補間)。正規化後の小さな画像で行うので、切り
+ * 出した大きな画像を回転するより速い。縦方向には動かさない。
  */
 void
-angle_detect(cv::Mat img, int angles[N][N][ANGLES])
+deskew_shear(cv::Mat& img)
 {
-    int i, j;
-
-    for (i = 0; i < N; i++)
-        for (j = 0; j < N; j++)
-            for (int k = 0; k < ANGLES; k++) {
-                angles[i][j][k] = 0;
-            }
-
-    for (i = 0; i < SIZE_NORMALIZED - 2; i++)
-        for (j = 0; j < SIZE_NORMALIZED - 2; j++) {
-            // 0 1 2
-            // 7 8 3
-            // 6 5 4
-            int P0 = img.at<uchar>(i + 0, j + 0);
-            int P1 = img.at<uchar>(i + 0, j + 1);
-            int P2 = img.at<uchar>(i + 0, j + 2);
-            int P3 = img.at<uchar>(i + 1, j + 2);
-            int P4 = img.at<uchar>(i + 2, j + 2);
-            int P5 = img.at<uchar>(i + 2, j + 1);
-            int P6 = img.at<uchar>(i + 2, j + 0);
-            int P7 = img.at<uchar>(i + 1, j + 0);
-            int P8 = img.at<uchar>(i + 1, j + 1);
-
-            if (!P0 && !P1 && !P2 && !P3 && !P4 && !P5 && !P6 && !P7) {
-                continue;
-            }
-
-            if (!P8) {
-                continue;
-            }
-#if ANGLES == 8
-            // Angle 0
-            if (P7 && P3) {
-                angles[j / M][i / M][0] += 1;
-            }
+    cv::Moments m = cv::moments(img, false);
+    cv::Mat     img_deskew;
+    double      slant, shift, sx, f;
+    int         x, y, x0, a, b;
 
-            // Angle 1
-            if (P7 && P2 || P6 && P3) {
-                angles[j / M][i / M][1] += 1;
-            }
+    if (abs(m.mu02) < 1e-2) {
+        return; // no op
+    }
 
-            // Angle 2
-            if (P6 && P2) {
-                angles[j / M][i / M][2] += 1;
-            }
+    slant = m.mu11 / m.mu02;
+    if (abs(slant * (180 / M_PI)) > 50) {
+        return; // misdetection
+    }
 
-            // Angle 3
-            if (P6 && P1 || P5 && P2) {
-                angles[j / M][i / M][3] += 1;
-            }
+    img_deskew = cv::Mat::zeros(img.size(), CV_8UC1);
+    for (y = 0; y < img.rows; y++) {
+        const uchar* src = img.ptr<uchar>(y);
+        uchar*       dst = img_deskew.ptr<uchar>(y);
+
+        shift = slant * (y - m.m01 / m.m00);
+        for (x = 0; x < img.cols; x++) {
+            sx = x + shift;
+            x0 = (int)floor(sx);
+            f = sx - x0;
+            a = (0 <= x0 && x0 < img.cols) ? src[x0] : 0;
+            b = (0 <= x0 + 1 && x0 + 1 < img.cols) ? src[x0 + 1] : 0;
+            dst[x] = (uchar)(a * (1 - f) + b * f + 0.5);
+        }
+    }
 
-            // Angle 4
-            if (P1 && P5) {
-                angles[j / M][i / M][4] += 1;
-            }
+    img.release();
+    img = img_deskew;
+}
 
-            // Angle 5
-            if (P0 && P5 || P1 && P4) {
-                angles[j / M][i / M][5] += 1;
-            }
+/*
+ * 8近傍のパターンから線の方向の数への表
+ *
+ * 3x3の窓を上の行から順に3ビットずつ (各行は左から) 並べ、中心のビット
+ * を除いた1バイトを添字とする。近傍の画素は下位ビットから順に
+ * P0 P1 P2 P7 P3 P6 P5 P4 になる。値は中心を通る線の角度0..7を方向
+ * ごとに数えたもので、方向kをkバイト目として64ビットに詰める。
+ * ANGLES == 8ではkバイト目が角度kの有無になり、ANGLES == 4では角度kを
+ * 方向k / 2に数える。1ブロックの画素はM * M個なので各バイトは
+ * 2 * M * M (= 32) を超えず、ブロックごとの和もこの形のまま取れる。
+ */
+static unsigned long long angle_table[256];
+static int                angle_table_ready = FALSE;
 
-            // Angle 6
-            if (P0 && P4) {
-                angles[j / M][i / M][6] += 1;
-            }
+#if SIZE_NORMALIZED > THIN_WORD
+#error "angle_detect packs a row of the normalized image into a thin_word"
+#endif
 
-            // Angle 7
-            if (P7 && P4 || P0 && P3) {
-                angles[j / M][i / M][7] += 1;
-            }
-#else /* ANGLES == 4 */
+static void
+angle_table_init(void)
+{
+    int pattern, k;
+
+    for (pattern = 0; pattern < 256; pattern++) {
+        int P0 = pattern & 0x01, P1 = pattern & 0x02;
+        int P2 = pattern & 0x04, P7 = pattern & 0x08;
+        int P3 = pattern & 0x10, P6 = pattern & 0x20;
+        int P5 = pattern & 0x40, P4 = pattern & 0x80;
+        int angle[8];
+
+        // 0 1 2    3  2  1
+        // 7 8 3    ＼｜／
+        // 6 5 4    ー　ー 0
+        angle[0] = P7 && P3;
+        angle[1] = P7 && P2 || P6 && P3;
+        angle[2] = P6 && P2;
+        angle[3] = P6 && P1 || P5 && P2;
+        angle[4] = P1 && P5;
+        angle[5] = P0 && P5 || P1 && P4;
+        angle[6] = P0 && P4;
+        angle[7] = P7 && P4 || P0 && P3;
+
+        angle_table[pattern] = 0;
+        for (k = 0; k < 8; k++) {
+            angle_table[pattern] += (unsigned long long)angle[k]
+                                    << (k * ANGLES / 8 * 8);
+        }
+    }
+    angle_table_ready = TRUE;
+}
 
-            // 0 1 2    3  2  1
-            // 7 8 3    ＼｜／
-            // 6 5 4    ー　ー 0
+/**
+ * Detection of edge angles
+ *
+ * 各行を1語に詰め、3行の語のシフトで窓を作って表を引く。中心が背景の
+ * 画素は表の値を0にして加えるので、画素ごとの分岐は無い。
+ */
+void
+angle_detect(cv::Mat img, int angles[N][N][ANGLES])
+{
+    thin_word          row[SIZE_NORMALIZED];
+    unsigned long long count[N][N];
+    int                i, j, k, x;
 
-            // Angle 0
-            if (P7 && P3) {
-                angles[j / M][i / M][0] += 1;
-            }
+    if (!angle_table_ready) {
+        angle_table_init();
+    }
+    memset(count, 0, sizeof(count));
 
-            // Angle 1
-            if (P7 && P2 || P6 && P3) {
-                angles[j / M][i / M][0] += 1;
-            }
+    for (i = 0; i < SIZE_NORMALIZED; i++) {
+        const uchar* p = img.ptr<uchar>(i);
 
-            // Angle 2
-            if (P6 && P2) {
-                angles[j / M][i / M][1] += 1;
-            }
+        row[i] = 0;
+        for (j = 0; j < SIZE_NORMALIZED; j++) {
+            row[i] |= (thin_word)(p[j] != 0) << j;
+        }
+    }
 
-            // Angle 3
-            if (P6 && P1 || P5 && P2) {
-                angles[j / M][i / M][1] += 1;
-            }
+    for (i = 0; i < SIZE_NORMALIZED - 2; i++) {
+        // 0 1 2
+        // 7 8 3
+        // 6 5 4
+        thin_word above = row[i], cur = row[i + 1], below = row[i + 2];
 
-            // Angle 4
-            if (P1 && P5) {
-                angles[j / M][i / M][2] += 1;
-            }
+        // ブロックの幅ずつ和を取ってから加える (中心が無いブロックは飛ばす)
+        for (j = 0; j < SIZE_NORMALIZED - 2; j += M) {
+            unsigned long long sum = 0;
+            int                end = MIN(j + M, SIZE_NORMALIZED - 2);
 
-            // Angle 5
-            if (P0 && P5 || P1 && P4) {
-                angles[j / M][i / M][2] += 1;
+            if (!((cur >> (j + 1)) & ((1ULL << M) - 1))) {
+                continue;
             }
+            for (x = j; x < end; x++) {
+                int mid = (int)(cur >> x);
+                int pattern = (int)(above >> x & 7) | (mid & 1) << 3
+                              | (mid & 4) << 2 | (int)(below >> x & 7) << 5;
 
-            // Angle 6
-            if (P0 && P4) {
-                angles[j / M][i / M][3] += 1;
+                sum += angle_table[pattern]
+                       & -(unsigned long long)(mid >> 1 & 1);
             }
+            count[j / M][i / M] += sum;
+        }
+    }
 
-            // Angle 7
-            if (P7 && P4 || P0 && P3) {
-                angles[j / M][i / M][3] += 1;
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N; j++)
+            for (k = 0; k < ANGLES; k++) {
+                angles[i][j][k] = (count[i][j] >> (k * 8)) & 0xff;
             }
-#endif
-        }
 }
 
 /**
@@ -539,35 +676,20 @@ edensity_detect(int angles[N][N][ANGLES], int edensity[N][N])
 void
 angle_blur(int src[N][N][ANGLES], int dst[N][N][ANGLES])
 {
-    short  x, y, i, j, nu;
-    double total_weight, weight;
+    short  x, y, nu;
+    double total_weight, wsum[N];
     double blur[N][N][ANGLES];
 
-    // XXX: これは定数ではないか？
-    total_weight = 0;
-    for (i = -2; i <= 2; i++)
-        for (j = -2; j <= 2; j++) {
-            total_weight += Gauss[ABS(i)][ABS(j)];
-        }
+    // 分散σ^2=4のガウス関数で、範囲は±2画素
+    total_weight = blur_border(blur_gauss4, 2, wsum);
+    blur_separable(&src[0][0][0], &blur[0][0][0], ANGLES, blur_gauss4, 2);
 
-    for (nu = 0; nu < 8; nu++) {
-        for (x = 0; x < N; x++) {
-            for (y = 0; y < N; y++) {
-                blur[x][y][nu] = 0.0;
-                weight = 0.0;
-                for (i = -2; i <= 2; i++) {
-                    for (j = -2; j <= 2; j++) {
-                        if ((x + i >= 0) && (x + i < N)) {
-                            if ((y + j >= 0) && (y + j < N)) {
-                                blur[x][y][nu] += (double)src[x + i][y + j][nu]
-                                                * Gauss[ABS(i)][ABS(j)];
-                                weight += Gauss[ABS(i)][ABS(j)];
-                            }
-                        }
-                    }
-                }
+    for (x = 0; x < N; x++) {
+        for (y = 0; y < N; y++) {
+            for (nu = 0; nu < ANGLES; nu++) {
                 dst[x][y][nu] = blur[x][y][nu];
-                dst[x][y][nu] *= total_weight / weight;
+                dst[x][y][nu] *= (total_weight * total_weight)
+                               / (wsum[x] * wsum[y]);
             }
         }
     }
@@ -576,6 +698,19 @@ angle_blur(int src[N][N][ANGLES], int dst[N][N][ANGLES])
 int
 Extract_Feature(cv::Mat img_src, int features[N][N][ANGLES])
 // Extract_Feature(cv::Mat img_src, int features[N][N])
+{
+    return Extract_Feature_deskew(img_src, features, DESKEW_ROTATE);
+}
+
+/**
+ * 傾き補正の方法 (DESKEW_*) を指定して特徴抽出する
+ *
+ * DESKEW_ROTATEは切り出した画像をINTER_CUBICで回転し、DESKEW_SHEARは
+ * SIZE_NORMALIZEDに縮小した後にせん断する。学習と認識では同じ方法を
+ * 用いること (kocrはデータベースのdeskewに記録した方法を用いる)。
+ */
+int
+Extract_Feature_deskew(cv::Mat img_src, int features[N][N][ANGLES], int mode)
 {
     cv::Mat img_bw;
     cv::Mat img_eroded;
@@ -595,6 +730,24 @@ Extract_Feature(cv::Mat img_src, int features[N][N][ANGLES])
     t = (double)cvGetTickCount();
 #endif
 
+    /*
+     * 大きすぎる入力の縮小 (以降の処理の画像の大きさを抑える)
+     */
+    int scaled_width, scaled_height;
+    if (downscale_size(img_src.cols,
+                       img_src.rows,
+                       &scaled_width,
+                       &scaled_height)) {
+        cv::Mat img_scaled;
+        cv::resize(img_src,
+                   img_scaled,
+                   cv::Size(scaled_width, scaled_height),
+                   0,
+                   0,
+                   cv::INTER_AREA);
+        img_src = img_scaled;
+    }
+
     /*
      * 白黒画像取得
      */
@@ -618,6 +771,30 @@ Extract_Feature(cv::Mat img_src, int features[N][N][ANGLES])
     img_dilated = cv::Mat(img_bw.size(), CV_8UC1);
     img_eroded = cv::Mat(img_bw.size(), CV_8UC1);
 
+    // ラベリング結果の領域 (バックトラックしても画像の大きさは変わらない)
+    int    area = img_bw.size().height * img_bw.size().width;
+    short* cc_result = (short*)pool_get(&work, area * sizeof(short));
+
+    int           size_x, size_y, top_x, top_y, bottom_x, bottom_y;
+    int           cc, num_of_cc = 0;
+    int           src_width, src_height, dst_width, dst_height, dst_size;
+    int           padding_x, padding_y;
+    double        aspect_ratio;
+    RegionInfoBS* ri;
+
+    // 段階ごとの結果が現在の画像に対応しているか
+    // (バックトラックしても変わらない結果は計算し直さない)
+    int   stage;
+    int   aliased = FALSE;       // img_erodedがimg_bwと領域を共有している
+    int   dilated_ok = FALSE;    // img_dilated = img_bwの膨張
+    int   eroded_ok = FALSE;     // img_eroded = img_dilatedの収縮, thickness2
+    int   thickness1_ok = FALSE; // thickness1 = img_bwの線の太さ
+    int   labeled_ok = FALSE;    // labeling, cc_result = img_erodedのラベリング
+    long  rounds = stats.rounds;
+    int64 rest = 0;
+
+    stats.calls++;
+
     // やるべき処理
     //
     // かすれ画像: 膨張・収縮で実線化
@@ -628,127 +805,180 @@ Extract_Feature(cv::Mat img_src, int features[N][N][ANGLES])
     //   閉じるべきでないループを閉じない (6の右上)
     //   閉じるべきでないループを閉じない (8や9の小さなループ)
 
-backtrack:
-    cv::dilate(img_bw, img_dilated, element, cv::Point(-1, -1), 1);
-    cv::erode(img_dilated, img_eroded, element, cv::Point(-1, -1), 1);
-
-    // ループの消失をチェック
-    cv::distanceTransform(img_bw, img_distance, CV_DIST_L2, 3);
-    cv::minMaxLoc(img_distance, &dist_min, &thickness1);
-    img_distance.release(); // メモリリーク対策 (不要？)
-
-    cv::distanceTransform(img_eroded, img_distance, CV_DIST_L2, 3);
-    cv::minMaxLoc(img_distance, &dist_min, &thickness2);
-
-    // 中心線抽出処理 (太線の際、中心線のみを抽出する)
-    if (!cc_turn && thickness2 > 8) { //  && thickness2 < 14) {
-        // printf("%s: %d, %d\n", filename, (int) thickness2, cc_turn);
-
-        for (i = 0; i < img_eroded.size().height; i++)
-            for (j = 0; j < img_eroded.size().width; j++) {
-                // このthicknessの閾値により、認識精度がわずかに変化する
-                if (img_distance.at<float>(i, j) > thickness2 - 1) {
-                    img_eroded.at<uchar>(i, j) = 0;
-                } else if (img_distance.at<float>(i, j) < thickness2 / 2 - 1) {
-                    img_eroded.at<uchar>(i, j) = 0;
+    stage = STAGE_MORPH;
+    while (stage != STAGE_DONE) {
+        int64 t = cv::getTickCount();
+        int   current = stage;
+
+        switch (stage) {
+        case STAGE_MORPH:
+            stats.rounds++;
+            if (!dilated_ok) {
+                cv::dilate(img_bw,
+                           img_dilated,
+                           element,
+                           cv::Point(-1, -1),
+                           1);
+                stats.ops[OP_DILATE]++;
+                dilated_ok = TRUE;
+            }
+            if (!eroded_ok) {
+                cv::erode(img_dilated,
+                          img_eroded,
+                          element,
+                          cv::Point(-1, -1),
+                          1);
+                stats.ops[OP_ERODE]++;
+                labeled_ok = FALSE;
+
+                // ループの消失をチェック
+                if (aliased) {
+                    // 収縮でimg_bwも書き換わったので、太さは同じ画像から求まる
+                    cv::distanceTransform(img_eroded,
+                                          img_distance,
+                                          CV_DIST_L2,
+                                          3);
+                    cv::minMaxLoc(img_distance, &dist_min, &thickness2);
+                    stats.ops[OP_DISTANCE]++;
+                    thickness1 = thickness2;
+                    dilated_ok = FALSE;
+                } else {
+                    if (!thickness1_ok) {
+                        cv::distanceTransform(img_bw,
+                                              img_distance,
+                                              CV_DIST_L2,
+                                              3);
+                        cv::minMaxLoc(img_distance, &dist_min, &thickness1);
+                        stats.ops[OP_DISTANCE]++;
+                        thickness1_ok = TRUE;
+                    }
+                    cv::distanceTransform(img_eroded,
+                                          img_distance,
+                                          CV_DIST_L2,
+                                          3);
+                    cv::minMaxLoc(img_distance, &dist_min, &thickness2);
+                    stats.ops[OP_DISTANCE]++;
+                    eroded_ok = TRUE;
                 }
             }
-    }
 
-    if ((double)(thickness2 / thickness1)
-        > (ELIMINATION_THRESHOLD + size_turn)) {
-        img_eroded.release(); // メモリリーク対策 (不要？)
-        img_eroded = img_bw;
-    }
+            // 中心線抽出処理 (太線の際、中心線のみを抽出する)
+            if (!cc_turn && thickness2 > 8) { //  && thickness2 < 14) {
+                // printf("%s: %d, %d\n", filename, (int) thickness2,
+                // cc_turn);
+
+                for (i = 0; i < img_eroded.size().height; i++)
+                    for (j = 0; j < img_eroded.size().width; j++) {
+                        // このthicknessの閾値により、認識精度がわずかに
+                        // 変化する
+                        if (img_distance.at<float>(i, j) > thickness2 - 1) {
+                            img_eroded.at<uchar>(i, j) = 0;
+                        } else if (img_distance.at<float>(i, j)
+                                   < thickness2 / 2 - 1) {
+                            img_eroded.at<uchar>(i, j) = 0;
+                        }
+                    }
+                eroded_ok = labeled_ok = FALSE;
+            }
 
-    /*
-     * ラベリング処理 (罫線除去・ノイズ除去・文字要素の抽出)
-     */
-    unsigned char* img_label =
-        new unsigned char[img_eroded.size().height * img_eroded.size().width];
-    short* cc_result =
-        new short[img_eroded.size().height * img_eroded.size().width];
-    int           size_x, size_y, top_x, top_y, bottom_x, bottom_y;
-    int           cc, num_of_cc;
-    int           src_width, src_height, dst_width, dst_height, dst_size;
-    int           padding_x, padding_y;
-    double        aspect_ratio;
-    RegionInfoBS* ri;
+            if ((double)(thickness2 / thickness1)
+                > (ELIMINATION_THRESHOLD + size_turn)) {
+                img_eroded.release(); // メモリリーク対策 (不要？)
+                img_eroded = img_bw;
+                aliased = TRUE;
+                eroded_ok = labeled_ok = FALSE;
+            }
+            stage = STAGE_LABEL;
+            break;
 
-    // ラベリング用データ生成 (XXX: 非効率)
-    for (i = 0; i < img_eroded.size().width; i++) {
-        for (j = 0; j < img_eroded.size().height; j++) {
-            img_label[j * img_eroded.size().width + i] =
-                img_eroded.at<uchar>(j, i); // atは (y, x)
-        }
-    }
+        case STAGE_LABEL:
+            /*
+             * ラベリング処理 (罫線除去・ノイズ除去・文字要素の抽出)
+             */
+            if (!labeled_ok) {
+                // img_erodedを行の間隔 (step) ごとそのまま渡す
+                // true: 領域の大きな順にソートする場合
+                // 3: 領域検出の最小領域
+                labeling.Exec(img_eroded.data,
+                              (int)img_eroded.step,
+                              cc_result,
+                              img_eroded.size().width,
+                              img_eroded.size().height,
+                              true,
+                              3);
+                stats.ops[OP_LABELING]++;
+                labeled_ok = TRUE;
+            }
 
-    // true: 領域の大きな順にソートする場合
-    // 3: 領域検出の最小領域
-    labeling.Exec(img_label,
-                  cc_result,
-                  img_eroded.size().width,
-                  img_eroded.size().height,
-                  true,
-                  3);
+            num_of_cc = labeling.GetNumOfResultRegions();
+            stage = num_of_cc ? STAGE_SELECT : STAGE_DONE;
+            break;
 
-    num_of_cc = labeling.GetNumOfResultRegions();
-    if (!num_of_cc) {
-        ret = ERR_RTN;
-        goto finish;
-    }
+        case STAGE_SELECT:
+            //「罫線らしくないCCのうち、最大サイズのCC」を文字として選択
+            for (cc = 0; cc < num_of_cc; cc++) {
+                ri = labeling.GetResultRegionInfo(cc);
+                ri->GetSize(size_x, size_y);
+                if (size_x > size_y) {
+                    aspect_ratio = (double)size_x / (double)size_y;
+                } else {
+                    aspect_ratio = (double)size_y / (double)size_x;
+                }
 
-    //「罫線らしくないCCのうち、最大サイズのCC」を文字として選択
-    for (cc = 0; cc < num_of_cc; cc++) {
-        ri = labeling.GetResultRegionInfo(cc);
-        ri->GetSize(size_x, size_y);
-        if (size_x > size_y) {
-            aspect_ratio = (double)size_x / (double)size_y;
-        } else {
-            aspect_ratio = (double)size_y / (double)size_x;
-        }
+                // 罫線っぽい連結成分をスキップ
+                if (!((aspect_ratio > 8)
+                      && (size_x > img_eroded.size().width - 2
+                          || size_y > img_eroded.size().height - 2)
+                      // (ri->GetNumOfPixels()
+                      //  > img_eroded.size().height / 2)
+                      )) {
+                    break;
+                }
+            }
+            stage = STAGE_DONE;
+
+            // 文字カスレが疑われれば、1回に限りバックトラック
+            if (cc_turn++ < 2 && cc + 1 < num_of_cc) {
+                int size_a = ri->GetNumOfPixels();
+                ri = labeling.GetResultRegionInfo(cc + 1);
+                int size_b = ri->GetNumOfPixels();
+                if (size_a / size_b < 10) {
+                    // 要素を1つのみ選択するアルゴリズムのため、膨張して結合する
+                    // 目的でバックトラックをしているが、一定サイズの要素を複数
+                    // 選択する実装に変更した方が良いかもしれない
+                    stage = STAGE_MORPH;
+                    break;
+                }
+                ri = labeling.GetResultRegionInfo(cc);
+            }
 
-        // 罫線っぽい連結成分をスキップ
-        if (!((aspect_ratio > 8)
-              && (size_x > img_eroded.size().width - 2
-                  || size_y > img_eroded.size().height - 2)
-              // (ri->GetNumOfPixels() > img_eroded.size().height / 2)
-              )) {
+            // 切り出し用サイズの生成
+            ri->GetMax(top_x, top_y);
+            ri->GetMin(bottom_x, bottom_y);
+            src_width = img_eroded.size().width;
+            src_height = img_eroded.size().height;
+            dst_width = ABS(top_x - bottom_x);
+            dst_height = ABS(top_y - bottom_y);
+            dst_size = MAX(dst_width, dst_height) + 2; // 上下マージン
+
+            // 文字サイズが小さければ、カスレの閾値について再検証
+            if (size_turn == 0 && dst_width < 40 && dst_height < 40) {
+                size_turn = 0.05;
+                if ((double)(thickness2 / thickness1)
+                    < (ELIMINATION_THRESHOLD + size_turn)) {
+                    stage = STAGE_MORPH;
+                }
+            }
             break;
         }
+        stats.ticks[current] += cv::getTickCount() - t;
     }
-
-    // 文字カスレが疑われれば、1回に限りバックトラック
-    if (cc_turn++ < 2 && cc + 1 < num_of_cc) {
-        int size_a = ri->GetNumOfPixels();
-        ri = labeling.GetResultRegionInfo(cc + 1);
-        int size_b = ri->GetNumOfPixels();
-        if (size_a / size_b < 10) {
-            // 要素を1つのみ選択するアルゴリズムのため、膨張して結合する目的で
-            // バックトラックをしているが、一定サイズの要素を複数選択する実装に
-            // 変更した方が良いかもしれない
-            goto backtrack;
-        }
-        ri = labeling.GetResultRegionInfo(cc);
-    }
-
-    // 切り出し用サイズの生成
-    ri->GetMax(top_x, top_y);
-    ri->GetMin(bottom_x, bottom_y);
-    src_width = img_eroded.size().width;
-    src_height = img_eroded.size().height;
-    dst_width = ABS(top_x - bottom_x);
-    dst_height = ABS(top_y - bottom_y);
-    dst_size = MAX(dst_width, dst_height) + 2; // 上下マージン
-
-    // 文字サイズが小さければ、カスレの閾値について再検証
-    if (size_turn == 0 && dst_width < 40 && dst_height < 40) {
-        size_turn = 0.05;
-        if ((double)(thickness2 / thickness1)
-            < (ELIMINATION_THRESHOLD + size_turn)) {
-            goto backtrack;
-        }
+    stats.hist[MIN(stats.rounds - rounds, STATS_HIST) - 1]++;
+    if (!num_of_cc) {
+        ret = ERR_RTN;
+        goto finish;
     }
+    rest = cv::getTickCount();
 
     /*
      * 対象要素の切り出し
@@ -764,7 +994,7 @@ backtrack:
             if (i + bottom_x - padding_x < src_width
                 && j + bottom_y - padding_y < src_height
                 && 0 < i + bottom_x - padding_x
-                && 0 < j + bottom_y - padding_y < src_height) {
+                && 0 <= j + bottom_y - padding_y) {
                 if (cc_result[src_width * (j + bottom_y - padding_y) + i
                               + bottom_x - padding_x]
                     == (cc + 1)) {
@@ -779,7 +1009,9 @@ backtrack:
     /*
      * Deskew処理
      */
-    deskew(img_extracted);
+    if (mode == DESKEW_ROTATE) {
+        deskew(img_extracted);
+    }
 
     /*
      * サイズ正規化処理
@@ -790,6 +1022,9 @@ backtrack:
            SIZE_NORMALIZED / img_extracted.size().width,
            SIZE_NORMALIZED / img_extracted.size().height,
            CV_INTER_AREA);
+    if (mode == DESKEW_SHEAR) {
+        deskew_shear(img_normalized);
+    }
 
     // 外周マージン再確保 (各種アルゴリズム上、マージンがあるほうが効率が良い)
     for (i = 0; i < SIZE_NORMALIZED; i++) {
@@ -887,6 +1122,10 @@ backtrack:
 #endif /* THINNING_MAIN */
 
 finish:
+    if (rest) {
+        stats.ticks[STAGE_DONE] += cv::getTickCount() - rest;
+    }
+    pool_put(&work, cc_result);
     img_bw.release();
     img_eroded.release();
     img_dilated.release();
@@ -901,6 +1140,14 @@ finish:
 int
 Extract_Feature_wrapper(char* fname, int features[N][N][ANGLES])
 // Extract_Feature_wrapper(char *fname, int features[N][N])
+{
+    return Extract_Feature_wrapper_deskew(fname, features, DESKEW_ROTATE);
+}
+
+int
+Extract_Feature_wrapper_deskew(char* fname,
+                               int   features[N][N][ANGLES],
+                               int   mode)
 {
     cv::Mat img_src;
     int     ret;
@@ -919,12 +1166,55 @@ Extract_Feature_wrapper(char* fname, int features[N][N][ANGLES])
     strcpy(filename, fname);
     strncpy(strrchr(filename, '.'), "-conv.png", 10);
 
-    ret = Extract_Feature(img_src, features);
+    ret = Extract_Feature_deskew(img_src, features, mode);
     filename[0] = '\0';
 
     return ret;
 }
 
+/**
+ * Extract_Featureの段階ごとの統計を出力する (プロファイル用)
+ *
+ * 判定の回数の分布、段階ごとの時間と判定1回 (切り出し以降は呼出し1回)
+ * あたりの時間、画像処理ごとの実行回数を出す。
+ */
+void
+Extract_Feature_stats(FILE* fp)
+{
+    static const char* stage_name[] = { "morph", "label", "select", "extract" };
+    static const char* op_name[]
+        = { "dilate", "erode", "distance", "labeling" };
+    double us = cv::getTickFrequency() / 1e6;
+    long   n;
+    int    i;
+
+    fprintf(fp,
+            "# Extract_Feature: %ld calls, %ld rounds\n",
+            stats.calls,
+            stats.rounds);
+    fprintf(fp, "# rounds calls\n");
+    for (i = 0; i < STATS_HIST; i++) {
+        fprintf(fp,
+                "%d%s %ld\n",
+                i + 1,
+                i == STATS_HIST - 1 ? "+" : "",
+                stats.hist[i]);
+    }
+    fprintf(fp, "# stage time(ms) per-round(us)\n");
+    for (i = 0; i <= STAGE_DONE; i++) {
+        n = (i == STAGE_DONE) ? stats.calls : stats.rounds;
+        fprintf(fp,
+                "%s %.1f %.2f\n",
+                stage_name[i],
+                stats.ticks[i] / us / 1000,
+                n ? stats.ticks[i] / us / n : 0.0);
+    }
+    fprintf(fp, "# op count\n");
+    for (i = 0; i < OPS; i++) {
+        fprintf(fp, "%s %ld\n", op_name[i], stats.ops[i]);
+    }
+}
+
 #ifdef THINNING_MAIN
 /**
  * For debugging purpose
@@ -1085,6 +1375,8 @@ usage(char* cmdName)
     printf("\t--show-image\tshow pre-processed images at each step\n");
     printf("\t--write-image=imagefile\twrite preprocessed images to the file "
            "in each step\n");
+    printf("\t--stats\tshow the statistics of each extraction stage\n");
+    printf("\t--deskew=none|rotate|shear\tdeskew method (default: rotate)\n");
 }
 
 int
@@ -1097,6 +1389,8 @@ main(int argc, char* argv[])
         {       "help",       no_argument, NULL, 'h'},
         { "show-image",       no_argument, NULL,   0},
         {"write-image", required_argument, NULL,   1},
+        {      "stats",       no_argument, NULL,   2},
+        {     "deskew", required_argument, NULL,   3},
         {            0,                 0,    0,   0},
     };
     while ((optid = getopt_long(argc, argv, "h", opts, &optindex)) != -1) {
@@ -1111,6 +1405,21 @@ main(int argc, char* argv[])
         case 1:
             writePreprocessedImageFileName = optarg;
             break;
+        case 2:
+            showStatsFlag = 1;
+            break;
+        case 3:
+            if (strcmp(optarg, "none") == 0) {
+                deskewMode = DESKEW_NONE;
+            } else if (strcmp(optarg, "rotate") == 0) {
+                deskewMode = DESKEW_ROTATE;
+            } else if (strcmp(optarg, "shear") == 0) {
+                deskewMode = DESKEW_SHEAR;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
         }
     }
 
@@ -1130,7 +1439,12 @@ main(int argc, char* argv[])
     return 0;
 #else
     int features[N][N][ANGLES];
-    return Extract_Feature_wrapper(argv[optind], features);
+    int ret =
+        Extract_Feature_wrapper_deskew(argv[optind], features, deskewMode);
+    if (showStatsFlag) {
+        Extract_Feature_stats(stdout);
+    }
+    return ret;
 #endif /* USE_CNN */
 }
 #endif